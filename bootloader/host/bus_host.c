@@ -0,0 +1,202 @@
+/* Shared bus for several bootloader_host devices */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+ * bootloader_bus joins the UART1 terminals of several emulators into one
+ * terminal for the host tool, like the RS-485 bus host_tools/fw_broadcast
+ * is written for. Every byte the tool sends goes to every device, and
+ * whatever a device sends goes to the tool. Only the polled device
+ * answers, so replies never collide.
+ *
+ *     bootloader_bus [--bus LINK] [--drop N:PAGE] DEVICE_UART1...
+ *
+ * --drop damages the first full page broadcast for PAGE on the way to the
+ * Nth device (from 0), so that device has to get it in a repair round.
+ */
+#define MAX_DEVICES 16
+#define BCAST_SYNC 0xB5
+#define PAGE_SIZE 256
+
+typedef struct {
+    int fd;  // Slave side of the device's UART1
+    int drop_page;  // -1 for none
+    unsigned char window[5];  // Last bytes sent to the device
+    bool damage_next;
+} device_t;
+
+static device_t devices[MAX_DEVICES];
+static int device_count;
+
+static void set_raw(int fd, const char *name) {
+    struct termios raw;
+
+    if (tcgetattr(fd, &raw) != 0) {
+        perror(name);
+        exit(1);
+    }
+    cfmakeraw(&raw);
+    tcsetattr(fd, TCSANOW, &raw);  // TCSAFLUSH would drop what is queued
+}
+
+static int bus_open(const char *link) {
+    const char *name;
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0
+        || (name = ptsname(master)) == NULL) {
+        perror("bootloader_bus: pseudo terminal");
+        exit(1);
+    }
+    // Held open so the bus never sees a hang up between tools
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror(name);
+        exit(1);
+    }
+    set_raw(slave, name);
+
+    unlink(link);
+    if (symlink(name, link) != 0) {
+        perror(link);
+        exit(1);
+    }
+    fprintf(stderr, "bootloader_bus: %s -> %s\n", link, name);
+    return master;
+}
+
+static void write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bootloader_bus: write");
+            exit(1);
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+/*
+ * Pass bytes from the tool on to one device. A full page packet starts with
+ * the sync byte, the page number and a length of 256, the byte after that
+ * is the first of the ciphertext and is the one damaged.
+ */
+static void forward(device_t *device, const unsigned char *data, size_t length) {
+    unsigned char out[256];
+    const unsigned char page_start[5] = {
+        BCAST_SYNC, device->drop_page >> 8, device->drop_page & 0xFF,
+        PAGE_SIZE >> 8, PAGE_SIZE & 0xFF
+    };
+
+    for (size_t i = 0; i < length; i++) {
+        out[i] = data[i];
+        if (device->damage_next) {
+            out[i] ^= 0x01;
+            device->damage_next = false;
+            device->drop_page = -1;
+        }
+        memmove(device->window, device->window + 1, sizeof(device->window) - 1);
+        device->window[sizeof(device->window) - 1] = data[i];
+        if (device->drop_page >= 0
+            && memcmp(device->window, page_start, sizeof(page_start)) == 0) {
+            device->damage_next = true;
+        }
+    }
+    write_all(device->fd, out, length);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--bus LINK] [--drop N:PAGE] DEVICE_UART1...\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "bus", required_argument, NULL, 'b' },
+        { "drop", required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct pollfd fds[MAX_DEVICES + 1];
+    unsigned char buffer[256];
+    const char *bus_link = "bus";
+    int drop_device = -1;
+    int drop_page = -1;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'b': bus_link = optarg; break;
+        case 'd':
+            if (sscanf(optarg, "%d:%d", &drop_device, &drop_page) != 2 || drop_page < 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || argc - optind > MAX_DEVICES) {
+        usage(argv[0]);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        device_t *device = &devices[device_count];
+        device->fd = open(argv[i], O_RDWR | O_NOCTTY);
+        if (device->fd < 0) {
+            perror(argv[i]);
+            exit(1);
+        }
+        set_raw(device->fd, argv[i]);
+        device->drop_page = device_count == drop_device ? drop_page : -1;
+        device_count++;
+    }
+    int bus = bus_open(bus_link);
+
+    fds[0].fd = bus;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < device_count; i++) {
+        fds[i + 1].fd = devices[i].fd;
+        fds[i + 1].events = POLLIN;
+    }
+
+    while (1) {
+        if (poll(fds, device_count + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bootloader_bus: poll");
+            exit(1);
+        }
+        if (fds[0].revents & POLLIN) {
+            ssize_t length = read(bus, buffer, sizeof(buffer));
+            for (int i = 0; i < device_count && length > 0; i++) {
+                forward(&devices[i], buffer, length);
+            }
+        }
+        for (int i = 0; i < device_count; i++) {
+            if (fds[i + 1].revents & POLLIN) {
+                ssize_t length = read(devices[i].fd, buffer, sizeof(buffer));
+                if (length > 0) {
+                    write_all(bus, buffer, length);
+                }
+            }
+            else if (fds[i + 1].revents & (POLLHUP | POLLERR)) {
+                fprintf(stderr, "bootloader_bus: device %d has gone away\n", i);
+                exit(1);
+            }
+        }
+    }
+}
@@ -0,0 +1,469 @@
+/* Hardware abstraction layer, Linux backend */
+#define _GNU_SOURCE
+#define HAL_HOST_BACKEND
+#include <fcntl.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal.h"
+#include "flash.h"
+#include "stack.h"
+#include "trace.h"
+
+#define HAL_HOST_RWW_END 0x1E000UL  // The boot section can not be programmed
+
+volatile uint8_t PINB;
+volatile uint8_t DDRB;
+volatile uint8_t PORTB;
+volatile uint8_t MCUCR;
+volatile uint8_t RAMPZ;
+volatile uint8_t GPIOR0;
+volatile uint8_t GPIOR1;
+uint8_t hal_host_mailbox[8] __attribute__ ((aligned (2)));
+
+// Bounds of the EEMEM section, from the linker
+extern uint8_t __start_eeprom[];
+extern uint8_t __stop_eeprom[];
+
+static uint8_t *flash;
+static uint8_t *eeprom;
+static uint8_t spm_buffer[SPM_PAGESIZE];
+static uint64_t spm_busy_until;
+static bool rww_busy;
+static uint64_t eeprom_busy_until;
+static bool instant;  // --instant, SPM and EEPROM writes take no time
+static uint32_t wdt_period_us;  // 0 while the watchdog is off
+static uint64_t wdt_deadline;
+static uint64_t clock_started;
+static uint8_t jumpers;  // PINB as the jumpers leave it
+static jmp_buf reset_point;
+
+uint64_t hal_host_now_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void busy_for(uint64_t *until, uint32_t us) {
+    *until = instant ? 0 : hal_host_now_us() + us;
+}
+
+static void wait_until(uint64_t until) {
+    while (hal_host_now_us() < until) {
+        hal_host_watchdog_check();
+        usleep(100);
+    }
+}
+
+/*
+ * Start over from main(), as the chip does after a reset. Whatever the
+ * bootloader had in RAM stays, as it does on the chip.
+ */
+static void hal_host_reset(uint8_t cause) {
+    GPIOR0 = cause;
+    longjmp(reset_point, 1);
+}
+
+void hal_host_watchdog_check(void) {
+    if (wdt_period_us != 0 && hal_host_now_us() >= wdt_deadline) {
+        fprintf(stderr, "hal_host: watchdog reset\n");
+        hal_host_reset(1 << WDRF);
+    }
+}
+
+void sleep_cpu(void) {
+    hal_host_uart_wait();
+    hal_host_watchdog_check();
+}
+
+void wdt_enable(uint8_t timeout) {
+    wdt_period_us = 16000UL << timeout;  // 16 ms to 2 s, as the 128 kHz oscillator gives
+    wdt_reset();
+}
+
+void wdt_reset(void) {
+    wdt_deadline = hal_host_now_us() + wdt_period_us;
+}
+
+void wdt_disable(void) {
+    wdt_period_us = 0;
+}
+
+void _delay_us(double us) {
+    usleep((useconds_t) us);
+}
+
+void hal_clock_start(void) {
+    clock_started = hal_host_now_us();
+}
+
+uint32_t hal_clock_ms(void) {
+    return (hal_host_now_us() - clock_started) / 1000;
+}
+
+/*
+ * EEPROM address of an EEMEM variable.
+ */
+static size_t eeprom_offset(const void *addr, size_t n) {
+    size_t offset = (const uint8_t *) addr - __start_eeprom;
+
+    if ((const uint8_t *) addr < __start_eeprom || offset + n > HAL_HOST_EEPROM_SIZE) {
+        fprintf(stderr, "hal_host: EEPROM access outside EEMEM at %p\n", addr);
+        abort();
+    }
+    return offset;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+    wait_until(eeprom_busy_until);  // Reads wait for a write to finish
+    memcpy(dst, eeprom + eeprom_offset(src, n), n);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+    uint8_t value;
+
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr) {
+    uint16_t value;
+
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+uint32_t eeprom_read_dword(const uint32_t *addr) {
+    uint32_t value;
+
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+    size_t offset = eeprom_offset(addr, 1);
+
+    wait_until(eeprom_busy_until);
+    eeprom[offset] = value;
+    busy_for(&eeprom_busy_until, HAL_HOST_EEPROM_US);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+    if (eeprom_read_byte(addr) != value) {
+        eeprom_write_byte(addr, value);
+    }
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        eeprom_update_byte((uint8_t *) dst + i, ((const uint8_t *) src)[i]);
+    }
+}
+
+void eeprom_update_word(uint16_t *addr, uint16_t value) {
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_dword(uint32_t *addr, uint32_t value) {
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+bool eeprom_is_ready(void) {
+    return hal_host_now_us() >= eeprom_busy_until;
+}
+
+static uint32_t spm_page(uint32_t addr) {
+    if (addr >= HAL_HOST_RWW_END) {
+        fprintf(stderr, "hal_host: SPM outside the application section at 0x%05x\n", addr);
+        abort();
+    }
+    return addr & ~(uint32_t)(SPM_PAGESIZE - 1);
+}
+
+void boot_page_erase(uint32_t addr) {
+    memset(flash + spm_page(addr), 0xFF, SPM_PAGESIZE);
+    rww_busy = true;
+    busy_for(&spm_busy_until, HAL_HOST_SPM_US);
+}
+
+void boot_page_fill(uint32_t addr, uint16_t word) {
+    spm_buffer[addr & (SPM_PAGESIZE - 2)] = (uint8_t) word;
+    spm_buffer[(addr & (SPM_PAGESIZE - 2)) + 1] = (uint8_t)(word >> 8);
+}
+
+void boot_page_write(uint32_t addr) {
+    uint8_t *page = flash + spm_page(addr);
+
+    // Programming only clears bits, a page that was not erased shows it
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+        page[i] &= spm_buffer[i];
+    }
+    memset(spm_buffer, 0xFF, SPM_PAGESIZE);
+    rww_busy = true;
+    busy_for(&spm_busy_until, HAL_HOST_SPM_US);
+}
+
+void boot_rww_enable(void) {
+    memset(spm_buffer, 0xFF, SPM_PAGESIZE);  // Also throws away the page buffer
+    if (!boot_spm_busy()) {
+        rww_busy = false;
+    }
+}
+
+bool boot_spm_busy(void) {
+    return hal_host_now_us() < spm_busy_until;
+}
+
+bool boot_rww_busy(void) {
+    return rww_busy;
+}
+
+void boot_spm_busy_wait(void) {
+    wait_until(spm_busy_until);
+}
+
+// The _safe forms also wait for the EEPROM, SPM can not start during a write
+void boot_page_erase_safe(uint32_t addr) {
+    boot_spm_busy_wait();
+    wait_until(eeprom_busy_until);
+    boot_page_erase(addr);
+}
+
+void boot_page_fill_safe(uint32_t addr, uint16_t word) {
+    boot_spm_busy_wait();
+    wait_until(eeprom_busy_until);
+    boot_page_fill(addr, word);
+}
+
+void boot_page_write_safe(uint32_t addr) {
+    boot_spm_busy_wait();
+    wait_until(eeprom_busy_until);
+    boot_page_write(addr);
+}
+
+void boot_rww_enable_safe(void) {
+    boot_spm_busy_wait();
+    wait_until(eeprom_busy_until);
+    boot_rww_enable();
+}
+
+static void flash_check_read(uint32_t addr, uint16_t len) {
+    if (addr + len > HAL_HOST_FLASH_SIZE) {
+        fprintf(stderr, "hal_host: flash read past the end at 0x%05x\n", addr);
+        abort();
+    }
+    if (rww_busy && addr < HAL_HOST_RWW_END) {
+        // The chip reads garbage here, say so instead
+        fprintf(stderr, "hal_host: RWW section read at 0x%05x while it is busy\n", addr);
+    }
+}
+
+uint8_t pgm_read_byte_far(uint32_t addr) {
+    flash_check_read(addr, 1);
+    return flash[addr];
+}
+
+const uint8_t *hal_host_flash(void) {
+    return flash;
+}
+
+void flash_read_block(uint32_t addr, uint8_t *dst, uint16_t len) {
+    flash_check_read(addr, len);
+    memcpy(dst, flash + addr, len);
+}
+
+uint8_t flash_compare_block(uint32_t addr, const uint8_t *src, uint16_t len) {
+    flash_check_read(addr, len);
+    return memcmp(flash + addr, src, len) != 0;
+}
+
+uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+    crc ^= (uint16_t) data << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+void hal_start_application(void) {
+    fprintf(stderr, "hal_host: jumping to the application\n");
+    exit(0);
+}
+
+/*
+ * The host paints a window below the caller of stack_paint() instead of the
+ * RAM above .bss. The depth it reports is what the same code needs on the
+ * host, 64 bit pointers and all, so it shows which paths go deep rather than
+ * what the chip has left, make sim measures that.
+ */
+#define HAL_HOST_STACK_WINDOW 0x10000
+#define HAL_HOST_STACK_PAINTED (1 << 0)  // In GPIOR1 like stack.c, cleared by a reset
+
+static uint8_t *stack_top;  // Frame of stack_paint()
+static uintptr_t stack_bottom;  // Lowest painted byte
+
+static void __attribute__ ((noinline)) stack_paint_window(void) {
+    uint8_t window[HAL_HOST_STACK_WINDOW];
+
+    memset(window, STACK_PAINT, sizeof(window));
+    asm volatile ("" : : "r" (window) : "memory");  // The fill must happen
+    stack_bottom = (uintptr_t) window;
+}
+
+void stack_paint(void) {
+    stack_top = __builtin_frame_address(0);
+    stack_paint_window();
+    GPIOR1 |= HAL_HOST_STACK_PAINTED;
+}
+
+uint16_t stack_unused(void) {
+    uint8_t *p = (uint8_t *) stack_bottom;
+
+    if (!(GPIOR1 & HAL_HOST_STACK_PAINTED)) {
+        return 0;
+    }
+    while (p < stack_top && *p == STACK_PAINT) {
+        p++;
+    }
+    return p - (uint8_t *) stack_bottom;
+}
+
+void stack_report(void) {
+    if (GPIOR1 & HAL_HOST_STACK_PAINTED) {
+        uint16_t unused = stack_unused();
+        TRACE_INFO(TRACE_STACK, unused);
+        fprintf(stderr, "hal_host: lowest stack %lu bytes below stack_paint()%s\n",
+                (unsigned long)(stack_top - (uint8_t *) stack_bottom) - unused,
+                unused == 0 ? ", the whole window" : "");
+    }
+}
+
+/*
+ * Map an image file, creating it with the contents of init if it is new.
+ */
+static uint8_t *map_image(const char *path, size_t size, const uint8_t *init, size_t init_len) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    if (st.st_size != 0 && (size_t) st.st_size != size) {
+        fprintf(stderr, "hal_host: %s is not %zu bytes\n", path, size);
+        exit(1);
+    }
+    if (st.st_size == 0 && ftruncate(fd, size) != 0) {
+        perror(path);
+        exit(1);
+    }
+
+    uint8_t *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    if (st.st_size == 0) {
+        memset(image, 0xFF, size);  // Erased
+        memcpy(image, init, init_len);
+    }
+    return image;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--flash FILE] [--eeprom FILE] [--uart1 LINK] [--uart0 LINK]\n"
+            "       [--jumper update|readback|none] [--instant]\n"
+            "       [--baud N] [--error-rate P] [--seed N]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "flash", required_argument, NULL, 'f' },
+        { "eeprom", required_argument, NULL, 'e' },
+        { "uart1", required_argument, NULL, '1' },
+        { "uart0", required_argument, NULL, '0' },
+        { "jumper", required_argument, NULL, 'j' },
+        { "instant", no_argument, NULL, 'i' },
+        { "baud", required_argument, NULL, 'b' },
+        { "error-rate", required_argument, NULL, 'r' },
+        { "seed", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *flash_path = "flash.bin";
+    const char *eeprom_path = "eeprom.bin";
+    const char *uart1_link = "uart1";
+    const char *uart0_link = "uart0";
+    uint32_t baud = 0;
+    double error_rate = 0;
+    unsigned int seed = 1;
+    int opt;
+
+    jumpers = 0xFF;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f': flash_path = optarg; break;
+        case 'e': eeprom_path = optarg; break;
+        case '1': uart1_link = optarg; break;
+        case '0': uart0_link = optarg; break;
+        case 'i': instant = true; break;
+        case 'b': baud = strtoul(optarg, NULL, 10); break;
+        case 'r': error_rate = strtod(optarg, NULL); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'j':
+            if (strcmp(optarg, "update") == 0) {
+                jumpers &= ~(1 << PB2);
+            }
+            else if (strcmp(optarg, "readback") == 0) {
+                jumpers &= ~(1 << PB3);
+            }
+            else if (strcmp(optarg, "none") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    flash = map_image(flash_path, HAL_HOST_FLASH_SIZE, NULL, 0);
+    eeprom = map_image(eeprom_path, HAL_HOST_EEPROM_SIZE, __start_eeprom,
+                       __stop_eeprom - __start_eeprom);
+    hal_host_uart_open(uart1_link, uart0_link);
+    hal_host_uart_line(baud, error_rate, seed);
+    setvbuf(stderr, NULL, _IONBF, 0);
+
+    GPIOR0 = 1;  // PORF, a power on reset
+    setjmp(reset_point);  // Comes back here on every reset
+
+    // What a reset puts back, RAM is left as it was
+    wdt_period_us = 0;
+    GPIOR1 = 0;
+    PINB = jumpers;
+    DDRB = 0;
+    PORTB = 0;
+    MCUCR = 0;
+    RAMPZ = 0;
+    memset(spm_buffer, 0xFF, SPM_PAGESIZE);
+    rww_busy = boot_spm_busy();
+
+    bootloader_main();
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* Hardware abstraction layer, Linux backend */
+#ifndef HAL_HOST_H_
+#define HAL_HOST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/*
+ * Stands in for the avr-libc calls and registers the bootloader uses (see
+ * hal.h). Flash and EEPROM are memory mapped files, UART1 and UART0 are
+ * pseudo terminals (host/uart_host.c), and a watchdog reset unwinds back to
+ * main() with longjmp, so the terminals stay open across resets just as
+ * the serial cable does. Nothing here is meant to be fast, it only has to
+ * behave like the chip: SPM and EEPROM writes keep the busy flags up for
+ * as long as the datasheet says, unless the emulator runs with --instant.
+ */
+#define HAL_HOST_FLASH_SIZE 0x20000UL
+#define HAL_HOST_EEPROM_SIZE 0x1000
+#define HAL_HOST_SPM_US 4000      // Page erase or write, 3.7 to 4.5 ms
+#define HAL_HOST_EEPROM_US 3400   // One EEPROM byte, 3.3 ms
+
+#define SPM_PAGESIZE 256
+
+// EEMEM variables are gathered in one section, their offset in it is their
+// EEPROM address. The initial values are the contents of a new EEPROM file.
+#define EEMEM __attribute__ ((section ("eeprom")))
+
+// bootloader.c's main() is called from the emulator's own main() after
+// every reset
+#ifndef HAL_HOST_BACKEND
+#define main bootloader_main
+#endif
+int bootloader_main(void);
+
+// Registers that are only ever read or written as plain values
+extern volatile uint8_t PINB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t MCUCR;
+extern volatile uint8_t RAMPZ;
+extern volatile uint8_t GPIOR0;  // Reset cause, as __Init leaves it
+extern volatile uint8_t GPIOR1;
+#define PB2 2
+#define PB3 3
+#define WDRF 3
+
+// UART1's link settings as UART1_set_baud() leaves them, for mailbox_arm()
+extern volatile uint16_t UBRR1;
+extern volatile uint8_t UCSR1A;
+#define U2X1 1
+
+// The application mailbox, kept where a watchdog reset leaves it alone
+extern uint8_t hal_host_mailbox[8];
+#define MAILBOX ((volatile mailbox_t *) hal_host_mailbox)
+
+// There are no interrupts, waiting is done in sleep_cpu()
+#define cli()
+#define sei()
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+
+/*
+ * Wait for input on UART1 for up to a millisecond, the tick Timer0 gives
+ * on the chip. Resets if the watchdog has run out.
+ */
+void sleep_cpu(void);
+
+#define WDTO_15MS 0
+#define WDTO_30MS 1
+#define WDTO_60MS 2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S 6
+#define WDTO_2S 7
+void wdt_enable(uint8_t timeout);
+void wdt_reset(void);
+void wdt_disable(void);
+
+void _delay_us(double us);
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+uint32_t eeprom_read_dword(const uint32_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_word(uint16_t *addr, uint16_t value);
+void eeprom_update_dword(uint32_t *addr, uint32_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+bool eeprom_is_ready(void);
+
+// SPM with the RWW section, addresses are flash byte addresses
+void boot_page_erase(uint32_t addr);
+void boot_page_fill(uint32_t addr, uint16_t word);
+void boot_page_write(uint32_t addr);
+void boot_rww_enable(void);
+bool boot_spm_busy(void);
+bool boot_rww_busy(void);
+void boot_spm_busy_wait(void);
+void boot_page_erase_safe(uint32_t addr);
+void boot_page_fill_safe(uint32_t addr, uint16_t word);
+void boot_page_write_safe(uint32_t addr);
+void boot_rww_enable_safe(void);
+
+/*
+ * Reads the application flash. Constants the bootloader itself keeps in
+ * PROGMEM are ordinary host memory, see host/include/avr/pgmspace.h.
+ */
+uint8_t pgm_read_byte_far(uint32_t addr);
+
+uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data);
+uint16_t _crc16_update(uint16_t crc, uint8_t data);
+
+void hal_clock_start(void);
+uint32_t hal_clock_ms(void);
+
+/*
+ * The emulator has no application to run, it reports the jump and exits.
+ */
+void hal_start_application(void) __attribute__ ((noreturn));
+
+/*
+ * Shared by host/hal_host.c and host/uart_host.c.
+ */
+const uint8_t *hal_host_flash(void);
+void hal_host_watchdog_check(void);
+uint64_t hal_host_now_us(void);
+void hal_host_uart_open(const char *uart1_link, const char *uart0_link);
+
+/*
+ * Pace UART1 at baud (0 for as fast as the terminal goes) and flip a random
+ * bit in each received byte with probability error_rate, for fw_bench.
+ */
+void hal_host_uart_line(uint32_t baud, double error_rate, unsigned int seed);
+
+/*
+ * Wait up to a millisecond for the next byte to arrive on UART1.
+ */
+void hal_host_uart_wait(void);
+
+#endif
@@ -0,0 +1,25 @@
+/* Program memory access for the host build */
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * For the constant tables of the vendored crypto code and bootloader.c. On
+ * the host those tables are ordinary memory, so a "far address" is just a
+ * pointer. Reads of the application flash go through pgm_read_byte_far() in
+ * hal_host.h instead.
+ */
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_get_far_address(var) ((uintptr_t) &(var))
+#define pgm_read_dword_far(addr) (*(const uint32_t *)(uintptr_t)(addr))
+#define memcpy_PF(dest, src, length) memcpy((dest), (const void *)(uintptr_t)(src), (length))
+
+#endif
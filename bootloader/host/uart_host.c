@@ -0,0 +1,261 @@
+/* UART and trace channel, Linux backend */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include "hal.h"
+#include "uart.h"
+#include "trace.h"
+#include "sched.h"
+
+/*
+ * Each UART is the master side of a pseudo terminal, the host tools open
+ * the slave side through the symlink given on the command line. Baud rate
+ * settings mean nothing to a pseudo terminal and are ignored, UART1 runs at
+ * the emulator's --baud instead (see hal_host_uart_line()).
+ */
+#define RX_SLACK_US 2000  // Bytes that may have arrived while we were asleep
+typedef struct {
+    int master;
+    int slave;  // Held open so the master never sees a hang up between tools
+    unsigned char rx[256];  // Same ring as uart.c, lost on a reset
+    uint8_t rx_head;
+    uint8_t rx_tail;
+    bool line;  // Paced and given errors, UART1 only
+    uint64_t rx_next;  // When the next byte can have arrived
+    uint64_t tx_next;  // When the last byte sent is out
+} host_uart_t;
+
+static host_uart_t uart1 = { .master = -1, .slave = -1, .line = true };
+static host_uart_t uart0 = { .master = -1, .slave = -1 };
+static uint32_t byte_us;  // One byte on the line, 0 for no pacing
+static double error_rate;
+static uint64_t rx1_deadline;  // For UART1_getchar_timeout()
+
+volatile uint16_t UBRR1;
+volatile uint8_t UCSR1A;
+
+static void uart_open(host_uart_t *uart, const char *link) {
+    struct termios raw;
+    const char *name;
+
+    uart->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (uart->master < 0 || grantpt(uart->master) != 0 || unlockpt(uart->master) != 0
+        || (name = ptsname(uart->master)) == NULL) {
+        perror("hal_host: pseudo terminal");
+        exit(1);
+    }
+    uart->slave = open(name, O_RDWR | O_NOCTTY);
+    if (uart->slave < 0 || tcgetattr(uart->slave, &raw) != 0) {
+        perror(name);
+        exit(1);
+    }
+    cfmakeraw(&raw);
+    tcsetattr(uart->slave, TCSANOW, &raw);
+    fcntl(uart->master, F_SETFL, fcntl(uart->master, F_GETFL) | O_NONBLOCK);
+
+    unlink(link);
+    if (symlink(name, link) != 0) {
+        perror(link);
+        exit(1);
+    }
+    fprintf(stderr, "hal_host: %s -> %s\n", link, name);
+}
+
+void hal_host_uart_open(const char *uart1_link, const char *uart0_link) {
+    uart_open(&uart1, uart1_link);
+    uart_open(&uart0, uart0_link);
+}
+
+void hal_host_uart_line(uint32_t baud, double rate, unsigned int seed) {
+    byte_us = baud != 0 ? 10000000UL / baud : 0;  // Start, 8 data and stop bits
+    error_rate = rate;
+    srandom(seed);
+}
+
+void hal_host_uart_wait(void) {
+    struct pollfd fd = { .fd = uart1.master, .events = POLLIN };
+    uint64_t now = hal_host_now_us();
+
+    if (byte_us != 0 && now < uart1.rx_next) {
+        // The terminal may already hold it, but it is still on the line
+        usleep(uart1.rx_next - now < 1000 ? uart1.rx_next - now : 1000);
+        return;
+    }
+    poll(&fd, 1, 1);
+}
+
+/*
+ * Move whatever the tool has sent into the receive ring.
+ */
+static void uart_fill(host_uart_t *uart) {
+    unsigned char byte;
+    uint64_t now = 0;
+
+    while ((uint8_t)(uart->rx_head + 1) != uart->rx_tail) {
+        if (uart->line && byte_us != 0) {
+            now = hal_host_now_us();
+            if (now < uart->rx_next) {
+                break;
+            }
+        }
+        if (read(uart->master, &byte, 1) != 1) {
+            break;
+        }
+        if (uart->line) {
+            if (uart->rx_next + RX_SLACK_US < now) {
+                uart->rx_next = now - RX_SLACK_US;  // The line was idle
+            }
+            uart->rx_next += byte_us;
+            if (error_rate > 0 && random() < error_rate * RAND_MAX) {
+                byte ^= 1 << (random() & 7);
+            }
+        }
+        uart->rx[uart->rx_head++] = byte;
+    }
+}
+
+/*
+ * Waits while the tool is not reading, like the shift register holding
+ * the next byte. UART0 drops the byte instead, nobody has to listen to it.
+ */
+static void uart_write(host_uart_t *uart, unsigned char data, bool drop) {
+    struct pollfd fd = { .fd = uart->master, .events = POLLOUT };
+    uint64_t now;
+
+    if (uart->line && byte_us != 0) {
+        while ((now = hal_host_now_us()) < uart->tx_next) {
+            hal_host_watchdog_check();
+            usleep(uart->tx_next - now);
+        }
+        uart->tx_next = now + byte_us;
+    }
+    while (write(uart->master, &data, 1) != 1) {
+        if (drop || (errno != EAGAIN && errno != EINTR)) {
+            return;
+        }
+        poll(&fd, 1, 1);
+        hal_host_watchdog_check();
+    }
+}
+
+void UART1_init(void) {
+    UBRR1 = 0;  // What BAUD gives, as far as mailbox_arm() is concerned
+    UCSR1A = 0;
+    uart1.rx_next = 0;
+    uart1.tx_next = 0;
+    uart1.rx_head = 0;
+    uart1.rx_tail = 0;
+}
+
+void UART1_set_baud(uint16_t ubrr, bool u2x) {
+    UBRR1 = ubrr;
+    UCSR1A = u2x ? (1 << U2X1) : 0;
+}
+
+void UART1_putchar(unsigned char data) {
+    uart_write(&uart1, data, false);
+}
+
+void UART1_putchar_buffered(unsigned char data) {
+    uart_write(&uart1, data, false);
+}
+
+void UART1_drain(void) {
+}
+
+bool UART1_data_available(void) {
+    uart_fill(&uart1);
+    return uart1.rx_head != uart1.rx_tail;
+}
+
+unsigned char UART1_getchar(void) {
+    while (!UART1_data_available()) {
+        sched_idle(UART1_data_available);  // Background work, else sleep
+    }
+    return uart1.rx[uart1.rx_tail++];
+}
+
+static bool rx1_ready_or_timed_out(void) {
+    return UART1_data_available() || hal_host_now_us() >= rx1_deadline;
+}
+
+int UART1_getchar_timeout(uint16_t timeout_ms) {
+    rx1_deadline = hal_host_now_us() + (uint64_t) timeout_ms * 1000;
+    while (!rx1_ready_or_timed_out()) {
+        sched_idle(rx1_ready_or_timed_out);
+    }
+    if (!UART1_data_available()) {
+        return -1;
+    }
+    return UART1_getchar();
+}
+
+void UART1_flush(void) {
+    uart_fill(&uart1);
+    uart1.rx_tail = uart1.rx_head;
+}
+
+void UART1_putstring(char* str) {
+    int i = 0;
+    while (str[i] != 0) {
+        UART1_putchar(str[i]);
+        i += 1;
+    }
+    UART1_putchar((unsigned char) 0);  // make sure we send out the null terminator
+}
+
+void UART0_init(void) {
+    uart0.rx_head = 0;
+    uart0.rx_tail = 0;
+}
+
+void UART0_putchar(unsigned char data) {
+    uart_write(&uart0, data, true);
+}
+
+bool UART0_data_available(void) {
+    uart_fill(&uart0);
+    return uart0.rx_head != uart0.rx_tail;
+}
+
+unsigned char UART0_getchar(void) {
+    while (!UART0_data_available()) {
+        sleep_cpu();
+    }
+    return uart0.rx[uart0.rx_tail++];
+}
+
+void UART0_flush(void) {
+    uart_fill(&uart0);
+    uart0.rx_tail = uart0.rx_head;
+}
+
+void UART0_putstring(char* str) {
+    int i = 0;
+    while (str[i] != 0) {
+        UART0_putchar(str[i]);
+        i += 1;
+    }
+    UART0_putchar((unsigned char) 0);  // make sure we send out the null terminator
+}
+
+// Records go straight to UART0, there is no ring to overflow
+void trace_init(void) {
+}
+
+void trace_record(uint8_t event, uint32_t arg) {
+    UART0_putchar(TRACE_SYNC);
+    UART0_putchar(event);
+    UART0_putchar((uint8_t)(arg >> 24));
+    UART0_putchar((uint8_t)(arg >> 16));
+    UART0_putchar((uint8_t)(arg >> 8));
+    UART0_putchar((uint8_t) arg);
+}
+
+void trace_flush(void) {
+}
@@ -0,0 +1,71 @@
+/* Bootloader services callable from the application */
+#ifndef BL_SERVICES_H_
+#define BL_SERVICES_H_
+
+#include <stdint.h>
+#include "sha256.h"
+
+/*
+ * A table of jmp instructions at a fixed address at the end of the boot
+ * section (see src/bl_services.c). Entries are only ever appended, so an
+ * application built against an older version keeps working; check
+ * bl_services_version() before calling an entry added after version 1.
+ * Nothing here uses interrupts or the bootloader's RAM, every call runs
+ * entirely on the caller's stack.
+ */
+#define BL_SERVICES_ADDR ((uint32_t) 0x1FFC0)
+#define BL_SERVICES_VERSION 2
+
+#define BL_SVC_VERSION 0
+#define BL_SVC_SHA256 1
+#define BL_SVC_SHA256_INIT 2
+#define BL_SVC_SHA256_NEXT_BLOCK 3
+#define BL_SVC_SHA256_LAST_BLOCK 4
+#define BL_SVC_SHA256_CTX2HASH 5
+#define BL_SVC_KEY_SCHEDULE 6
+#define BL_SVC_ENCRYPT 7
+#define BL_SVC_DECRYPT 8
+#define BL_SVC_FLASH_READ 9
+#define BL_SVC_RELEASE_MESSAGE 10  // Version 2
+#define BL_SVC_COUNT 11
+
+// Function pointers hold word addresses
+#define BL_SERVICE(n) ((uint16_t)((BL_SERVICES_ADDR + 4 * (n)) / 2))
+
+#define bl_services_version \
+    ((uint16_t (*)(void)) BL_SERVICE(BL_SVC_VERSION))
+#define bl_sha256 \
+    ((void (*)(uint8_t *, const uint8_t *, uint32_t)) BL_SERVICE(BL_SVC_SHA256))
+#define bl_sha256_init \
+    ((void (*)(sha256_ctx_t *)) BL_SERVICE(BL_SVC_SHA256_INIT))
+#define bl_sha256_nextBlock \
+    ((void (*)(sha256_ctx_t *, const void *)) BL_SERVICE(BL_SVC_SHA256_NEXT_BLOCK))
+#define bl_sha256_lastBlock \
+    ((void (*)(sha256_ctx_t *, const void *, uint16_t)) BL_SERVICE(BL_SVC_SHA256_LAST_BLOCK))
+#define bl_sha256_ctx2hash \
+    ((void (*)(void *, const sha256_ctx_t *)) BL_SERVICE(BL_SVC_SHA256_CTX2HASH))
+#define bl_RunEncryptionKeySchedule \
+    ((void (*)(uint8_t *, uint8_t *)) BL_SERVICE(BL_SVC_KEY_SCHEDULE))
+#define bl_Encrypt \
+    ((void (*)(uint8_t *, uint8_t *)) BL_SERVICE(BL_SVC_ENCRYPT))
+#define bl_Decrypt \
+    ((void (*)(uint8_t *, uint8_t *)) BL_SERVICE(BL_SVC_DECRYPT))
+#define bl_flash_read \
+    ((void (*)(void *, uint32_t, uint16_t)) BL_SERVICE(BL_SVC_FLASH_READ))
+#define bl_release_message \
+    ((uint32_t (*)(void)) BL_SERVICE(BL_SVC_RELEASE_MESSAGE))
+
+uint16_t bl_services_get_version(void);
+
+/*
+ * Copy length bytes of flash from any 32 bit address into RAM.
+ */
+void bl_services_flash_read(void *dest, uint32_t addr, uint16_t length);
+
+/*
+ * Flash address of the null terminated release message of the running
+ * image, for applications started by a FAST_BOOT bootloader to print.
+ */
+uint32_t bl_services_release_message(void);
+
+#endif
@@ -0,0 +1,20 @@
+/* Block reads from anywhere in flash */
+#ifndef FLASH_H_
+#define FLASH_H_
+
+#include <stdint.h>
+
+/*
+ * Copy len bytes of flash starting at the 32 bit byte address addr into dst.
+ * RAMPZ is loaded once and elpm Z+ carries into it, so a block may cross a
+ * 64 KB boundary. RAMPZ is left at 0.
+ */
+void flash_read_block(uint32_t addr, uint8_t *dst, uint16_t len);
+
+/*
+ * Compare len bytes of flash at addr with src. Returns 0 if they are the
+ * same, non zero at the first difference.
+ */
+uint8_t flash_compare_block(uint32_t addr, const uint8_t *src, uint16_t len);
+
+#endif
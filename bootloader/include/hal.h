@@ -0,0 +1,73 @@
+/* Hardware abstraction layer */
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+
+/*
+ * Everything the bootloader logic needs from the chip comes in through this
+ * header, so bootloader.c, sched.c, stats.c and mailbox.c also build for
+ * Linux with `make host` (HAL_HOST, see host/hal_host.h).
+ *
+ * Where avr-libc already gives a function or a plain macro (EEPROM, the
+ * watchdog, sleep, SPM page programming, far flash reads, CRCs, PINB and
+ * friends) the HAL keeps its name and the host backend supplies the same
+ * name. The few things avr-libc has no call for get a hal_ function here.
+ * The UARTs, the trace channel and block flash reads already sit behind
+ * uart.h, trace.h and flash.h, and the host has its own versions of those
+ * modules.
+ */
+#ifdef HAL_HOST
+#include "hal_host.h"
+#else
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+
+/*
+ * Start the millisecond clock stats.c times update sessions with. Timer3
+ * runs from F_CPU / 1024 and its overflow interrupt counts the high half.
+ */
+void hal_clock_start(void);
+uint32_t hal_clock_ms(void);
+
+/*
+ * Give the interrupt vectors back to the application and jump to it. The
+ * UART, trace, clock and profiler interrupts are switched off and their
+ * timers put back to the reset state first, otherwise the first sei() in the
+ * application would take them through its own vectors.
+ */
+static inline void hal_start_application(void) __attribute__ ((noreturn));
+static inline void hal_start_application(void) {
+    cli();
+    UCSR1B &= ~((1 << RXCIE1) | (1 << TXCIE1) | (1 << UDRIE1));
+    UCSR0B &= ~((1 << RXCIE0) | (1 << TXCIE0) | (1 << UDRIE0));
+    TCCR0B = 0;
+    TCCR1B = 0;
+    TCCR3B = 0;
+    TCCR0A = 0;
+    TCCR1A = 0;
+    TCCR3A = 0;
+    TIMSK0 = 0;
+    TIMSK1 = 0;
+    TIMSK3 = 0;
+    TIFR0 = 0xFF;  // Clear anything still pending
+    TIFR1 = 0xFF;
+    TIFR3 = 0xFF;
+    MCUCR = (1 << IVCE);
+    MCUCR = 0;
+    asm("jmp 0000");
+    __builtin_unreachable();
+}
+
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+/* Application to bootloader mailbox */
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The first bytes of SRAM are kept out of the bootloader's .data (see the
+ * Makefile) and are not touched by a watchdog reset, so the application can
+ * leave a request there and reset into the bootloader without a jumper:
+ *
+ *     volatile mailbox_t *mb = MAILBOX;
+ *     mb->command = MAILBOX_UPDATE;
+ *     mb->ubrr = UBRR1;              // 0 keeps the bootloader's BAUD
+ *     mb->u2x = UCSR1A & (1 << U2X1);
+ *     mb->magic = MAILBOX_MAGIC;
+ *     mb->check = mailbox_check(mb);
+ *     wdt_enable(WDTO_15MS);
+ *     while (1);
+ *
+ * The request is only honoured after a watchdog reset, power up leaves
+ * random RAM behind that could pass the check by chance.
+ */
+#define MAILBOX_ADDR 0x0100  // RAMSTART on the ATmega1284P
+#ifndef MAILBOX  // The host build keeps it in its own RAM, see host/hal_host.h
+#define MAILBOX ((volatile mailbox_t *) MAILBOX_ADDR)
+#endif
+#define MAILBOX_MAGIC ((uint16_t) 0xB007)
+
+#define MAILBOX_NONE ((uint8_t) 0x00)
+#define MAILBOX_UPDATE ((uint8_t) 'U')  // Go straight to load_firmware()
+
+typedef struct {
+    uint16_t magic;
+    uint8_t command;
+    uint8_t u2x;    // Non zero to run UART1 in double speed mode
+    uint16_t ubrr;  // UART1 baud rate register, 0 for the default
+    uint16_t check;
+} mailbox_t;
+
+static inline uint16_t mailbox_check(volatile mailbox_t *mb) {
+    return ~(mb->magic ^ ((uint16_t) mb->command << 8 | mb->u2x) ^ mb->ubrr);
+}
+
+/*
+ * True if the application has left a valid request, without taking it.
+ */
+bool mailbox_pending(void);
+
+/*
+ * Return the command left by the application and clear the mailbox, or
+ * MAILBOX_NONE if there is no valid request. Applies the link settings.
+ */
+uint8_t mailbox_take(void);
+
+/*
+ * Leave a request for the bootloader itself, with UART1's current settings,
+ * so the next watchdog reset comes back with the same command.
+ */
+void mailbox_arm(uint8_t command);
+
+void mailbox_clear(void);
+
+#endif
@@ -0,0 +1,56 @@
+/* Cycle counting profiler for the update loop */
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+/*
+ * Built in with PROFILE=1 from the Makefile, otherwise the macros below
+ * compile to nothing and Timer1 stays off. Timer1 counts CPU cycles with no
+ * prescaler and its overflow interrupt extends the count to 32 bits, which
+ * wraps after 214 s at 20 MHz; only differences are ever used.
+ *
+ * Each phase keeps the total, the number of times it ran and the shortest
+ * and longest run. Phases may nest in other phases (everything nests in
+ * PROF_PAGE, and background steps run inside PROF_RECEIVE), but a phase
+ * must not nest in itself.
+ */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+#define PROF_PAGE 0        // First frame of a page until it is programmed
+#define PROF_RECEIVE 1     // frame_read(), including background steps run while waiting
+#define PROF_HASH 2        // One SHA256 block, or the final block and digest
+#define PROF_TAG 3         // Encrypting a digest into a tag
+#define PROF_DECRYPT 4     // One 8 byte block
+#define PROF_ERASE 5       // Waiting for a page erase
+#define PROF_PROGRAM 6     // SPM page write
+#define PROF_JOURNAL 7     // EEPROM journal write
+#define PROF_IMAGE 8       // Hashing and checking the whole image
+#define PROF_PHASES 9
+
+void profile_init(void);
+void profile_start(uint8_t phase);
+void profile_stop(uint8_t phase);
+
+/*
+ * Send the summary as trace records: TRACE_PROFILE with F_CPU, then for
+ * each phase that ran TRACE_PROF_PHASE (phase << 24 | count) followed by
+ * TRACE_PROF_TOTAL, TRACE_PROF_MIN and TRACE_PROF_MAX in cycles.
+ */
+void profile_report(void);
+
+#if PROFILE
+#define PROFILE_INIT() profile_init()
+#define PROFILE_START(phase) profile_start(phase)
+#define PROFILE_STOP(phase) profile_stop(phase)
+#define PROFILE_REPORT() profile_report()
+#else
+#define PROFILE_INIT()
+#define PROFILE_START(phase)
+#define PROFILE_STOP(phase)
+#define PROFILE_REPORT()
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+/* Run to completion background tasks */
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A task is a step function called again and again from the bootloader's
+ * wait loops until it returns SCHED_DONE. Each call must do a bounded slice
+ * of work, at most SCHED_STEP_US, so waiting for the host never overruns a
+ * receive deadline or the watchdog. Received bytes are buffered by the UART1
+ * receive interrupt while a step runs. Steps must not wait on the UART
+ * themselves, and calling a step once it is done must just return SCHED_DONE.
+ */
+#define SCHED_DONE 0
+#define SCHED_AGAIN 1
+
+// Set from the Makefile, with 0 every task runs in sched_finish()
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 4
+#endif
+// Longest a single step may take, about one SHA256 block at 20 MHz
+#define SCHED_STEP_US 3000
+
+typedef uint8_t (*sched_step_t)(void *arg);
+
+void sched_init(void);
+
+/*
+ * Queue step(arg). Posting a task that is already queued does nothing.
+ * Returns 0 if the queue is full, the caller then does the work itself.
+ */
+uint8_t sched_post(sched_step_t step, void *arg);
+
+uint8_t sched_pending(sched_step_t step, void *arg);
+
+/*
+ * Run one step of the next queued task. Returns 0 if there was nothing to do.
+ */
+uint8_t sched_run(void);
+
+/*
+ * Called from wait loops. Runs one step, or if nothing is queued puts the CPU
+ * in idle sleep until the next interrupt. ready() is checked with interrupts
+ * off just before sleeping, so an interrupt that makes it true can not slip
+ * in between the check and the sleep.
+ */
+void sched_idle(bool (*ready)(void));
+
+/*
+ * Run steps until step(arg) is finished, used when its result is needed now.
+ * A task that could not be queued is run here directly.
+ */
+void sched_finish(sched_step_t step, void *arg);
+
+#endif
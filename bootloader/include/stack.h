@@ -0,0 +1,29 @@
+/* Stack high water mark */
+#ifndef STACK_H_
+#define STACK_H_
+
+#include <stdint.h>
+
+/*
+ * stack_paint() fills the free RAM between the end of .bss and the stack
+ * pointer with STACK_PAINT. The stack grows down into it, so the painted
+ * bytes still left at the bottom are RAM that was never used. Painting
+ * takes a few ms and is only done for update and readback sessions, never
+ * on the way to the application.
+ */
+#define STACK_PAINT ((uint8_t) 0xC5)
+
+void stack_paint(void);
+
+/*
+ * Bytes above the end of .bss that the stack has not reached since
+ * stack_paint(), 0 if it was never called after this reset.
+ */
+uint16_t stack_unused(void);
+
+/*
+ * Send a TRACE_STACK record with stack_unused(), if the stack was painted.
+ */
+void stack_report(void);
+
+#endif
@@ -0,0 +1,85 @@
+/* Persistent bootloader statistics */
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Counters kept in EEPROM across resets. Nothing is written while an update
+ * runs: a session only counts its NAKs in RAM, and stats_end() writes one
+ * record when the session is over. Records go round a ring of STATS_SLOTS,
+ * each with a sequence number and a CRC, so every slot is written once per
+ * STATS_SLOTS sessions and a record torn by a reset is skipped in favour of
+ * the one before it.
+ *
+ * Boots are counted in a ring of STATS_BOOT_RING bytes instead, one byte
+ * write per boot. The byte at the count modulo the ring size is moved on
+ * to the next lap, so each byte is written once every STATS_BOOT_RING
+ * boots. Only when the ring comes round to its erased state again is a
+ * record written, to add a lap of 256 * STATS_BOOT_RING boots.
+ */
+#define STATS_SLOTS 8
+#define STATS_BOOT_RING 16
+
+// Kinds of session
+#define STATS_NONE 0
+#define STATS_UPDATE 1
+#define STATS_READBACK 2
+
+// How an update session ended, anything not set is counted as aborted
+#define STATS_ABORTED 0
+#define STATS_OK 1
+#define STATS_AUTH_FAIL 2
+#define STATS_IMAGE_FAIL 3
+
+typedef struct {
+    uint16_t seq;          // Newest record has the highest, modulo 2^16
+    uint16_t updates;      // Update sessions started
+    uint16_t updates_ok;
+    uint16_t auth_fail;    // Ended on a page or group tag that did not match
+    uint16_t image_fail;   // Ended on an image tag that did not match
+    uint16_t aborted;      // Ended any other way: rejected, timed out or a bad patch
+    uint16_t readbacks;
+    uint16_t boot_laps;    // Times the boot ring came round
+    uint32_t naks;         // Frames the host had to resend
+    uint32_t session_ms;   // Time spent in all update sessions
+    uint32_t last_ms;      // Time spent in the latest update session
+    uint16_t crc;          // CRC-16 of everything above
+} stats_t;
+
+/*
+ * Reset the RAM state, called before anything can reach wait_for_reset().
+ */
+void stats_init(void);
+
+/*
+ * Start a session of the given kind and its clock, see hal_clock_start().
+ */
+void stats_begin(uint8_t session);
+
+void stats_result(uint8_t result);
+void stats_nak(void);
+
+/*
+ * Write the record for the session, if one was started. Called from
+ * wait_for_reset(), every session ends there.
+ */
+void stats_end(void);
+
+/*
+ * Count a boot into the application.
+ */
+void stats_boot(void);
+
+/*
+ * Boots counted so far.
+ */
+uint32_t stats_boots(void);
+
+/*
+ * Copy the newest valid record into stats, or zeros if there is none.
+ * Returns its slot, or STATS_SLOTS - 1 if there was none.
+ */
+uint8_t stats_load(stats_t *stats);
+
+#endif
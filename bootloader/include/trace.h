@@ -0,0 +1,84 @@
+/* Debug trace channel on UART0 */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Records at or below TRACE_LEVEL are compiled in, the rest cost nothing.
+ * TRACE_LEVEL is set from the Makefile.
+ */
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+/*
+ * Every record is 6 bytes on the wire:
+ *
+ * [ 0x01 ]  [ 0x01 ]  [ 0x04 ]
+ * ----------------------------
+ * |  Sync  |  Event  |  Arg  |
+ *
+ * Sync is always TRACE_SYNC and arg is big endian. host_tools/trace_decode
+ * knows the event names, keep the two lists in step.
+ */
+#define TRACE_SYNC ((uint8_t) 0xA5)
+#define TRACE_RECORD_SIZE 6
+
+#define TRACE_DROPPED ((uint8_t) 0x00)      // Records lost since the last one sent
+#define TRACE_UPDATE ((uint8_t) 0x01)       // Update started, arg is the bundle id
+#define TRACE_FRAME ((uint8_t) 0x02)        // Frame received, arg is its length
+#define TRACE_PAGE ((uint8_t) 0x03)         // Page programmed, arg is the next page address
+#define TRACE_SKIP ((uint8_t) 0x04)         // Page skipped, arg is its address
+#define TRACE_PATCH ((uint8_t) 0x05)        // Patch record announced, arg is its length
+#define TRACE_ADDRESS ((uint8_t) 0x06)      // Write position moved, arg is the new address
+#define TRACE_AUTH_FAIL ((uint8_t) 0x07)    // Tag did not match, arg is the page address
+#define TRACE_PATCH_FAIL ((uint8_t) 0x08)   // Patch record rejected, arg is the page address
+#define TRACE_IMAGE_OK ((uint8_t) 0x09)     // Image tag verified, arg is the firmware size
+#define TRACE_IMAGE_FAIL ((uint8_t) 0x0A)   // Image tag did not match, arg is the image end
+#define TRACE_NAK ((uint8_t) 0x0B)          // Bad or stalled frame, arg is the page to resend
+#define TRACE_STACK ((uint8_t) 0x0C)        // Session over, arg is the stack never used
+#define TRACE_PROFILE ((uint8_t) 0x0D)      // Profile summary follows, arg is F_CPU
+#define TRACE_PROF_PHASE ((uint8_t) 0x0E)   // arg is the phase << 24 | times it ran
+#define TRACE_PROF_TOTAL ((uint8_t) 0x0F)   // Cycles spent in that phase
+#define TRACE_PROF_MIN ((uint8_t) 0x10)     // Shortest run in cycles
+#define TRACE_PROF_MAX ((uint8_t) 0x11)     // Longest run in cycles
+
+void trace_init(void);
+
+/*
+ * Queue a record for the UART0 data register empty interrupt to send. Never
+ * waits: if the ring is full the record is dropped and counted, and a
+ * TRACE_DROPPED record goes out once there is room again.
+ */
+void trace_record(uint8_t event, uint32_t arg);
+
+/*
+ * Wait for every queued record to be sent, call before using UART0 directly.
+ */
+void trace_flush(void);
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_ERROR(event, arg)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_INFO(event, arg)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_DEBUG(event, arg)
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 #define UART_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * Initializes UART1
@@ -10,11 +11,30 @@
  */
 void UART1_init(void);
 
+/*
+ * Switch UART1 to another baud rate register value, for link settings the
+ * application handed over in the mailbox.
+ */
+void UART1_set_baud(uint16_t ubrr, bool u2x);
+
 void UART1_putchar(unsigned char data);
 
+/*
+ * Interrupt driven transmit, bytes are queued in a ring and sent by the
+ * USART1 UDRE interrupt. Drain before mixing with UART1_putchar().
+ */
+void UART1_putchar_buffered(unsigned char data);
+void UART1_drain(void);
+
 bool UART1_data_available(void);
 unsigned char UART1_getchar(void);
 
+/*
+ * Like UART1_getchar() but gives up after about timeout_ms milliseconds.
+ * Returns the byte received or -1 on a timeout.
+ */
+int UART1_getchar_timeout(uint16_t timeout_ms);
+
 void UART1_flush(void);
 
 void UART1_putstring(char* str);
@@ -0,0 +1,487 @@
+/* Cycle accurate run of the bootloader on the simavr ATmega1284P model */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_hex.h"
+#include "sim_irq.h"
+#include "sim_vcd_file.h"
+#include "avr_eeprom.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+
+/*
+ * Runs flash.hex, the image of bootloader_dbg.elf, instruction by
+ * instruction. simavr's ELF loader only takes .text and .data and would
+ * leave out .bl_services, the hex file has every section. UART1 and UART0
+ * are pseudo terminals as in the host build (host/uart_host.c), so the
+ * host tools drive it unchanged. simavr times the UARTs, timers and the
+ * watchdog from the cycle count, sleeping the CPU sleeps in real time.
+ *
+ * Every cycle is charged to the function the instruction belongs to, from
+ * `avr-nm -n` of bootloader_dbg.elf. When the bootloader jumps to the
+ * application, or on SIGINT, the profile, the reset to application latency
+ * and the lowest stack pointer are written and the run ends.
+ */
+#define SIM_MCU "atmega1284p"
+#define SIM_FLASH_SIZE 0x20000UL
+#define SIM_EEPROM_SIZE 0x1000
+#define SIM_BOOT_START 0x1E000UL  // BOOTRST, the reset vector is __vectors
+#define SIM_BOOT_WORDS ((SIM_FLASH_SIZE - SIM_BOOT_START) / 2)
+#define SIM_VECTORS_END 0x8C  // 35 vectors of 4 bytes
+
+// Data space addresses of the registers looked at between instructions
+#define SIM_MCUCR 0x55
+#define SIM_IVSEL 1
+#define SIM_SPMCSR 0x57
+#define SIM_SPL 0x5D
+#define SIM_SPH 0x5E
+
+#define SIM_OP_SPM 0x95E8
+#define SIM_OP_SPM_ZPLUS 0x95F8
+
+#define SIM_MAX_FUNCTIONS 512
+#define SIM_SLEEPING (SIM_MAX_FUNCTIONS)  // Profile slot for cycles spent asleep
+
+typedef struct {
+    uint32_t addr;
+    char name[64];
+    uint64_t cycles;
+    uint32_t calls;
+} sim_function_t;
+
+typedef struct {
+    int master;
+    int slave;  // Held open so the master never sees a hang up between tools
+    avr_irq_t *input;
+    bool xon;
+    bool drop;  // UART0 drops output nobody reads, UART1 waits
+} sim_uart_t;
+
+static avr_t *avr;
+static sim_function_t functions[SIM_MAX_FUNCTIONS + 1];
+static uint16_t function_count;
+static uint16_t function_of[SIM_BOOT_WORDS];  // Index per boot section word
+static uint32_t heap_start;  // __heap_start, the stack may grow down to it
+static uint16_t lowest_sp = 0xFFFF;
+static avr_cycle_count_t reset_cycle;
+static avr_cycle_count_t app_cycle;  // Cycles from reset to the application, 0 if never
+static sim_uart_t uart1;
+static sim_uart_t uart0;
+static avr_irq_t *spm_irq;
+static avr_vcd_t vcd;
+static bool vcd_on;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) {
+    running = 0;
+}
+
+/*
+ * Read `avr-nm -n` output and map every word of the boot section to the
+ * function that holds it.
+ */
+static void load_symbols(const char *path) {
+    char line[160];
+    char name[128];
+    char type;
+    unsigned long addr;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    strcpy(functions[0].name, "(unknown)");
+    function_count = 1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx %c %127s", &addr, &type, name) != 3) {
+            continue;
+        }
+        if (strcmp(name, "__heap_start") == 0) {
+            heap_start = addr & 0xFFFF;
+        }
+        if ((type != 'T' && type != 't' && type != 'W' && type != 'w')
+            || addr < SIM_BOOT_START || addr >= SIM_FLASH_SIZE
+            || function_count == SIM_MAX_FUNCTIONS) {
+            continue;
+        }
+        functions[function_count].addr = addr;
+        snprintf(functions[function_count].name, sizeof(functions[0].name), "%s", name);
+        function_count++;
+    }
+    fclose(f);
+
+    // nm -n sorts by address, each function runs up to the next symbol
+    uint16_t current = 0;
+    for (uint32_t word = 0; word < SIM_BOOT_WORDS; word++) {
+        uint32_t addr = SIM_BOOT_START + 2 * word;
+        while (current + 1 < function_count && functions[current + 1].addr <= addr) {
+            current++;
+        }
+        function_of[word] = current;
+    }
+    strcpy(functions[SIM_SLEEPING].name, "(sleeping)");
+}
+
+static void load_hex(const char *path, uint8_t *dst, uint32_t size) {
+    ihex_chunk_p chunks;
+    int count = read_ihex_chunks(path, &chunks);
+
+    if (count <= 0) {
+        fprintf(stderr, "bootloader_sim: can not read %s\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (chunks[i].baseaddr + chunks[i].size > size) {
+            fprintf(stderr, "bootloader_sim: %s does not fit at 0x%05x\n", path,
+                    chunks[i].baseaddr);
+            exit(1);
+        }
+        memcpy(dst + chunks[i].baseaddr, chunks[i].data, chunks[i].size);
+    }
+    free_ihex_chunks(chunks);
+}
+
+/*
+ * Raw images in the format of the host build (--flash, --eeprom of
+ * bootloader_host), so a device state can move between the two.
+ */
+static bool load_image(const char *path, uint8_t *dst, uint32_t size) {
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+    if (fread(dst, 1, size, f) != size) {
+        fprintf(stderr, "bootloader_sim: %s is not %u bytes\n", path, size);
+        exit(1);
+    }
+    fclose(f);
+    return true;
+}
+
+static void save_image(const char *path, const uint8_t *src, uint32_t size) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL || fwrite(src, 1, size, f) != size) {
+        perror(path);
+        return;
+    }
+    fclose(f);
+}
+
+static void uart_output(struct avr_irq_t *irq, uint32_t value, void *param) {
+    sim_uart_t *uart = param;
+    uint8_t data = value;
+    struct pollfd fd = { .fd = uart->master, .events = POLLOUT };
+
+    while (write(uart->master, &data, 1) != 1) {
+        if (uart->drop || (errno != EAGAIN && errno != EINTR)) {
+            return;
+        }
+        poll(&fd, 1, 1);
+    }
+}
+
+static void uart_xon(struct avr_irq_t *irq, uint32_t value, void *param) {
+    ((sim_uart_t *) param)->xon = true;
+}
+
+static void uart_xoff(struct avr_irq_t *irq, uint32_t value, void *param) {
+    ((sim_uart_t *) param)->xon = false;
+}
+
+static void uart_open(sim_uart_t *uart, char name, const char *link, bool drop) {
+    struct termios raw;
+    const char *pts;
+    uint32_t flags = 0;
+
+    uart->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (uart->master < 0 || grantpt(uart->master) != 0 || unlockpt(uart->master) != 0
+        || (pts = ptsname(uart->master)) == NULL) {
+        perror("bootloader_sim: pseudo terminal");
+        exit(1);
+    }
+    uart->slave = open(pts, O_RDWR | O_NOCTTY);
+    if (uart->slave < 0 || tcgetattr(uart->slave, &raw) != 0) {
+        perror(pts);
+        exit(1);
+    }
+    cfmakeraw(&raw);
+    tcsetattr(uart->slave, TCSANOW, &raw);
+    fcntl(uart->master, F_SETFL, fcntl(uart->master, F_GETFL) | O_NONBLOCK);
+    unlink(link);
+    if (symlink(pts, link) != 0) {
+        perror(link);
+        exit(1);
+    }
+    fprintf(stderr, "bootloader_sim: %s -> %s\n", link, pts);
+
+    // Bytes go to the terminal only, and polling UCSRnA must not sleep
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(name), &flags);
+    flags &= ~(AVR_UART_FLAG_STDIO | AVR_UART_FLAG_POOL_SLEEP);
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(name), &flags);
+
+    uart->input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_INPUT);
+    uart->xon = true;
+    uart->drop = drop;
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_OUTPUT),
+                            uart_output, uart);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_OUT_XON),
+                            uart_xon, uart);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_OUT_XOFF),
+                            uart_xoff, uart);
+}
+
+/*
+ * Hand what the tool has sent to simavr while the receive FIFO has room,
+ * simavr shifts it in at the programmed baud rate.
+ */
+static void uart_poll(sim_uart_t *uart) {
+    uint8_t data;
+
+    while (uart->xon && read(uart->master, &data, 1) == 1) {
+        avr_raise_irq(uart->input, data);
+    }
+}
+
+static void vcd_open(const char *path) {
+    static const char *names[] = { "spm" };
+
+    spm_irq = avr_alloc_irq(&avr->irq_pool, 0, 1, names);
+    if (avr_vcd_init(avr, path, &vcd, 100000) != 0) {
+        fprintf(stderr, "bootloader_sim: can not open %s\n", path);
+        exit(1);
+    }
+    avr_vcd_add_signal(&vcd, uart1.input, 8, "uart1_rx");
+    avr_vcd_add_signal(&vcd, avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUTPUT),
+                       8, "uart1_tx");
+    avr_vcd_add_signal(&vcd, avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+                       8, "uart0_tx");
+    avr_vcd_add_signal(&vcd, spm_irq, 8, "spm");  // SPMCSR of each SPM, 0 after it
+    avr_vcd_start(&vcd);
+    vcd_on = true;
+}
+
+static void write_profile(const char *path) {
+    static sim_function_t *sorted[SIM_MAX_FUNCTIONS + 1];
+    uint16_t count = 0;
+    uint64_t total = 0;
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    for (uint16_t i = 0; i <= SIM_MAX_FUNCTIONS; i++) {
+        if (functions[i].cycles != 0) {
+            sorted[count++] = &functions[i];
+            total += functions[i].cycles;
+        }
+    }
+    // Few entries, insertion sort by cycles
+    for (uint16_t i = 1; i < count; i++) {
+        sim_function_t *entry = sorted[i];
+        uint16_t j = i;
+        for (; j > 0 && sorted[j - 1]->cycles < entry->cycles; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = entry;
+    }
+
+    fprintf(f, "# %llu cycles at %u Hz\n", (unsigned long long) total, avr->frequency);
+    if (app_cycle != 0) {
+        fprintf(f, "# reset to application %llu cycles, %.1f us\n",
+                (unsigned long long) app_cycle, app_cycle * 1e6 / avr->frequency);
+    }
+    if (heap_start != 0 && lowest_sp != 0xFFFF) {
+        fprintf(f, "# lowest SP 0x%04x, %d bytes above __heap_start never used\n",
+                lowest_sp, (int) lowest_sp - (int) heap_start);
+    }
+    fprintf(f, "%14s %10s %6s %8s  %s\n", "cycles", "ms", "%", "calls", "function");
+    for (uint16_t i = 0; i < count; i++) {
+        fprintf(f, "%14llu %10.3f %6.2f %8u  %s\n", (unsigned long long) sorted[i]->cycles,
+                sorted[i]->cycles * 1e3 / avr->frequency, 100.0 * sorted[i]->cycles / total,
+                sorted[i]->calls, sorted[i]->name);
+    }
+    fclose(f);
+    fprintf(stderr, "bootloader_sim: profile in %s\n", path);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s --hex flash.hex --symbols bootloader.sym [--eeprom-hex eeprom.hex]\n"
+            "       [--flash FILE] [--eeprom FILE] [--uart1 LINK] [--uart0 LINK]\n"
+            "       [--jumper update|readback|none] [--vcd FILE] [--profile FILE]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "hex", required_argument, NULL, 'x' },
+        { "eeprom-hex", required_argument, NULL, 'E' },
+        { "symbols", required_argument, NULL, 's' },
+        { "flash", required_argument, NULL, 'f' },
+        { "eeprom", required_argument, NULL, 'e' },
+        { "uart1", required_argument, NULL, '1' },
+        { "uart0", required_argument, NULL, '0' },
+        { "jumper", required_argument, NULL, 'j' },
+        { "vcd", required_argument, NULL, 'v' },
+        { "profile", required_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *hex_path = NULL;
+    const char *eeprom_hex_path = NULL;
+    const char *symbols_path = NULL;
+    const char *flash_path = "flash.bin";
+    const char *eeprom_path = "eeprom.bin";
+    const char *uart1_link = "uart1";
+    const char *uart0_link = "uart0";
+    const char *vcd_path = NULL;
+    const char *profile_path = "sim_profile.txt";
+    const char *jumper = "none";
+    static uint8_t eeprom[SIM_EEPROM_SIZE];
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'x': hex_path = optarg; break;
+        case 'E': eeprom_hex_path = optarg; break;
+        case 's': symbols_path = optarg; break;
+        case 'f': flash_path = optarg; break;
+        case 'e': eeprom_path = optarg; break;
+        case '1': uart1_link = optarg; break;
+        case '0': uart0_link = optarg; break;
+        case 'j': jumper = optarg; break;
+        case 'v': vcd_path = optarg; break;
+        case 'p': profile_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (hex_path == NULL || symbols_path == NULL) {
+        usage(argv[0]);
+    }
+
+    avr = avr_make_mcu_by_name(SIM_MCU);
+    if (avr == NULL) {
+        fprintf(stderr, "bootloader_sim: simavr has no %s\n", SIM_MCU);
+        exit(1);
+    }
+    avr_init(avr);
+    avr->frequency = F_CPU;
+    avr->log = LOG_WARNING;
+
+    // The application as the last run left it, then the bootloader over it
+    memset(avr->flash, 0xFF, SIM_FLASH_SIZE);
+    load_image(flash_path, avr->flash, SIM_FLASH_SIZE);
+    load_hex(hex_path, avr->flash, SIM_FLASH_SIZE);
+    avr->codeend = SIM_FLASH_SIZE - 1;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (!load_image(eeprom_path, eeprom, sizeof(eeprom)) && eeprom_hex_path != NULL) {
+        load_hex(eeprom_hex_path, eeprom, sizeof(eeprom));
+    }
+    avr_eeprom_desc_t ee = { .ee = eeprom, .offset = 0, .size = sizeof(eeprom) };
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+    load_symbols(symbols_path);
+
+    avr->reset_pc = SIM_BOOT_START;
+    avr->pc = SIM_BOOT_START;
+
+    // simavr has no pull ups, drive both jumper pins, low where one is fitted
+    if (strcmp(jumper, "update") != 0 && strcmp(jumper, "readback") != 0
+        && strcmp(jumper, "none") != 0) {
+        usage(argv[0]);
+    }
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2),
+                  strcmp(jumper, "update") != 0);
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 3),
+                  strcmp(jumper, "readback") != 0);
+
+    uart_open(&uart1, '1', uart1_link, false);
+    uart_open(&uart0, '0', uart0_link, true);
+    if (vcd_path != NULL) {
+        vcd_open(vcd_path);
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    uint16_t current = 0;
+    uint32_t poll_countdown = 0;
+    bool spm_pending = false;
+    while (running) {
+        avr_flashaddr_t pc = avr->pc;
+        avr_cycle_count_t before = avr->cycle;
+        bool asleep = avr->state == cpu_Sleeping;
+
+        if (pc < SIM_BOOT_START) {
+            // hal_start_application() has cleared IVSEL and jumped
+            app_cycle = avr->cycle - reset_cycle;
+            fprintf(stderr, "bootloader_sim: jumping to the application after %llu cycles\n",
+                    (unsigned long long) app_cycle);
+            break;
+        }
+        if (pc == SIM_BOOT_START) {
+            reset_cycle = avr->cycle;  // Reset, or __bad_interrupt starting over
+        }
+
+        uint16_t opcode = avr->flash[pc] | (uint16_t) avr->flash[pc + 1] << 8;
+        if (vcd_on && (opcode == SIM_OP_SPM || opcode == SIM_OP_SPM_ZPLUS)) {
+            avr_raise_irq(spm_irq, avr->data[SIM_SPMCSR]);
+            spm_pending = true;
+        }
+
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "bootloader_sim: the CPU stopped at 0x%05x\n", avr->pc);
+            break;
+        }
+
+        // Charge the cycles to the function that ran
+        uint16_t function = asleep ? SIM_SLEEPING : function_of[(pc - SIM_BOOT_START) / 2];
+        if (function != current && !asleep && functions[function].addr == pc) {
+            functions[function].calls++;
+        }
+        functions[function].cycles += avr->cycle - before;
+        current = function;
+
+        if (spm_pending && opcode != SIM_OP_SPM && opcode != SIM_OP_SPM_ZPLUS) {
+            avr_raise_irq(spm_irq, 0);
+            spm_pending = false;
+        }
+
+        // simavr may not know IVSEL, send the interrupt to the boot section table
+        if (avr->pc < SIM_VECTORS_END && (avr->data[SIM_MCUCR] & (1 << SIM_IVSEL))) {
+            avr->pc += SIM_BOOT_START;
+        }
+
+        uint16_t sp = avr->data[SIM_SPL] | (uint16_t) avr->data[SIM_SPH] << 8;
+        if (sp < lowest_sp) {
+            lowest_sp = sp;
+        }
+
+        if (poll_countdown-- == 0 || asleep) {
+            poll_countdown = 1000;
+            uart_poll(&uart1);
+        }
+    }
+
+    if (vcd_on) {
+        avr_vcd_stop(&vcd);
+        avr_vcd_close(&vcd);
+    }
+    write_profile(profile_path);
+    save_image(flash_path, avr->flash, SIM_FLASH_SIZE);
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+    save_image(eeprom_path, ee.ee, SIM_EEPROM_SIZE);
+    avr_terminate(avr);
+    return 0;
+}
@@ -0,0 +1,43 @@
+/* Bootloader services callable from the application */
+#include <avr/eeprom.h>
+#include <stdint.h>
+#include "bl_services.h"
+#include "flash.h"
+
+void bl_services_table(void) __attribute__ ((naked)) __attribute__ ((used))
+    __attribute__ ((section (".bl_services")));
+
+/*
+ * Linked at BL_SERVICES_ADDR by the Makefile. Keep the order in step with
+ * the BL_SVC_ numbers and only ever add entries at the end.
+ */
+void bl_services_table(void) {
+    __asm__ __volatile__
+    (
+        "jmp bl_services_get_version    \n\t"
+        "jmp sha256                     \n\t"
+        "jmp sha256_init                \n\t"
+        "jmp sha256_nextBlock           \n\t"
+        "jmp sha256_lastBlock           \n\t"
+        "jmp sha256_ctx2hash            \n\t"
+        "jmp RunEncryptionKeySchedule   \n\t"
+        "jmp Encrypt                    \n\t"
+        "jmp Decrypt                    \n\t"
+        "jmp bl_services_flash_read     \n\t"
+        "jmp bl_services_release_message \n\t"
+    );
+}
+
+uint16_t bl_services_get_version(void) {
+    return BL_SERVICES_VERSION;
+}
+
+void bl_services_flash_read(void *dest, uint32_t addr, uint16_t length) {
+    flash_read_block(addr, dest, length);
+}
+
+extern uint32_t fw_size;  // EEPROM, defined in bootloader.c
+
+uint32_t bl_services_release_message(void) {
+    return eeprom_read_dword(&fw_size);  // The message follows the image
+}
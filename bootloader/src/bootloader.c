@@ -13,62 +13,380 @@
  * execute the application from flash.
  *
  * If data is sent on UART for an update, the bootloader will expect that data 
- * to be sent in frames. A frame consists of two sections:
+ * to be sent in frames. A frame consists of three sections:
  * 1. Two bytes for the length of the data section
  * 2. A data section of length defined in the length section
+ * 3. A CRC-16/XMODEM of the length and data
  *
- * [ 0x02 ]  [ variable ]
- * ----------------------
- * |  Length |  Data... |
+ * [ 0x02 ]  [ variable ]  [ 0x02 ]
+ * -------------------------------
+ * |  Length |  Data... |   CRC  |
  *
  * Frames are stored in an intermediate buffer until a complete page has been
  * sent, at which point the page is written to flash. See program_flash() for
- * information on the process of programming the flash memory. Note that if no
- * frame is received after 2 seconds, the bootloader will time out and reset.
+ * information on the process of programming the flash memory. Page tags carry
+ * a CRC the same way. If a CRC is wrong or the line stalls part way through a
+ * frame, the bootloader drops the partial page and answers NAK followed by the
+ * 4 byte address of the page it expects next, and the host sends that page
+ * again. A tag that arrives intact but does not authenticate still stops the
+ * update.
+ *
+ * Pages are written in ascending order starting at address 0. A frame with
+ * length FRAME_ADDRESS followed by a 4 byte page address moves the write
+ * position forward, and the pages jumped over are erased, so sparse images
+ * only send the pages they use. A frame with length FRAME_SKIP tells the
+ * bootloader that the page at the current address already holds the new
+ * contents, so it is left untouched.
+ * Before starting an update the host may send CMD_MANIFEST to get a digest of
+ * every page currently in flash and work out which pages it can skip, or send
+ * a FRAME_PATCH record that rebuilds the page from bytes already in flash. Since
+ * skipped pages are never authenticated on the wire, the whole image is hashed
+ * from flash and checked against the image tag before fw_size is committed.
+ *
+ * Progress is journaled in EEPROM together with the bundle id the host sends
+ * in the metadata. If an update is cut short the host sends CMD_JOURNAL after
+ * the reset and, when the id matches, skips the pages that are already done.
+ * fw_size stays 0 until finish_update() so a partial image never boots.
+ *
+ * The metadata also picks how pages are authenticated. With a tag span of 1
+ * every page carries its own tag and is checked before it is programmed.
+ * With a span of N, pages are programmed straight away and every N pages
+ * the host sends FRAME_TAG with a tag over the flash written since the last
+ * one, which is hashed in the background as pages land. A span of 0 leaves
+ * everything to the image tag and is only allowed with DUAL_SLOT, where the
+ * running image is untouched until then. Tags can be truncated to tag_len
+ * bytes, the image tag is always sent whole.
  *
  */
-#include <avr/io.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <util/delay.h>
+#include "hal.h"
 #include "uart.h"
-#include <avr/boot.h>
-#include <avr/wdt.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
+#include "trace.h"
 #include "encrypt.h"
 #include "decrypt.h"
 #include "encryption_key_schedule.h"
+#include "sched.h"
+#include "mailbox.h"
+#include "flash.h"
+#include "stack.h"
+#include "profile.h"
+#include "stats.h"
 #include <sha256.h>
 
 #define OK ((unsigned char) 0x00)
 #define ERROR ((unsigned char) 0x01)
+#define NAK ((unsigned char) 0x15)  // Followed by the 4 byte address to resend from
+
+// Longest gap allowed between bytes of a frame before it is given up on
+#define FRAME_TIMEOUT_MS 500
+
+// Resends asked for the same address before the session is given up on,
+// MAX_NAKS in fw_update. A host that has gone away costs one NAK per
+// 2 * FRAME_TIMEOUT_MS, so the watchdog resets the device after about 11 s.
+#define NAK_LIMIT 8
+
+// Commands accepted after the bootloader sends 'U'
+#define CMD_UPDATE ((unsigned char) 'U')
+#define CMD_MANIFEST ((unsigned char) 'M')
+#define CMD_JOURNAL ((unsigned char) 'J')
+#define CMD_ROLLBACK ((unsigned char) 'R')  // DUAL_SLOT only
+#define CMD_BROADCAST ((unsigned char) 'B')
+#define CMD_CAPABILITIES ((unsigned char) 'C')
+#define CMD_STATS ((unsigned char) 'S')
+
+// Frame length marking a page that is already up to date
+#define FRAME_SKIP ((uint16_t) 0xFFFF)
+// Frame length announcing that the next page arrives as a patch record
+#define FRAME_PATCH ((uint16_t) 0xFFFE)
+// Frame length followed by the address of the next page to program
+#define FRAME_ADDRESS ((uint16_t) 0xFFFD)
+// Frame length followed by the tag over the flash written since the last one
+#define FRAME_TAG ((uint16_t) 0xFFFC)
+
+// Tag spans and lengths the host may choose in the metadata
+#define TAG_MAX_SPAN 64  // Pages programmed before they must be checked
+#define TAG_MIN_LEN 8    // Shortest truncated tag accepted
+#define CAP_GROUP_TAGS ((uint8_t) 0x01)  // Spans above 1
+#define CAP_IMAGE_TAG ((uint8_t) 0x02)   // Span 0, the image tag only
+#define CAP_RUNNING_SLOT ((uint8_t) 0x04)  // Patches copy from a separate running slot
+
+// Manifest page count flag asking for the running image instead of staging
+#define MANIFEST_RUNNING ((uint16_t) 0x8000)
+
+// Patch record operations
+#define PATCH_END ((uint8_t) 0x00)
+#define PATCH_COPY ((uint8_t) 0x01)     // 3 byte flash address, 1 byte count
+#define PATCH_LITERAL ((uint8_t) 0x02)  // 1 byte count, then the bytes
+#define PATCH_FILL ((uint8_t) 0x03)     // 1 byte count, 1 byte value
+
+// Bytes of SHA256 kept per page in the manifest
+#define DIGEST_SIZE 4
+
+// The bootloader section starts here (see CLINKER in the Makefile)
+#define APP_SECTION_END ((uint32_t) 0x1E000)
+
+// Set to 1 to stream updates into a staging slot and swap it in once the
+// whole image has been authenticated
+#ifndef DUAL_SLOT
+#define DUAL_SLOT 0
+#endif
+
+#if DUAL_SLOT
+// Running slot at 0, staging slot above it and one scratch page for the swap
+#define SLOT_PAGES ((APP_SECTION_END / SPM_PAGESIZE - 1) / 2)
+#define SLOT_SIZE ((uint32_t) SLOT_PAGES * SPM_PAGESIZE)
+#define STAGING_BASE SLOT_SIZE
+#define SCRATCH_PAGE (2 * SLOT_SIZE)
+#define IMAGE_END SLOT_SIZE
+#else
+#define STAGING_BASE ((uint32_t) 0)  // Updates overwrite the running image
+#define IMAGE_END APP_SECTION_END
+#endif
+#define MANIFEST_PAGES (IMAGE_END / SPM_PAGESIZE)
+
+// Set to 1 to keep page digests in EEPROM as pages are programmed
+#ifndef MANIFEST_CACHE
+#define MANIFEST_CACHE 0
+#endif
+
+#ifndef DEVICE_ID
+#define DEVICE_ID 0
+#endif
+
+// Set to 1 to jump to the application without initializing the UARTs or
+// sending the release message, which the application can get from
+// bl_release_message() instead
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+// Time for the PB2 and PB3 pullups to charge the pins before they are read
+#define PIN_SETTLE_US 10
+
+#if MANIFEST_CACHE && DUAL_SLOT
+#error "The digest cache does not follow pages moved by a slot swap"
+#endif
+
+// Readback modes, sent by the host ahead of the start address
+#define READBACK_RAW ((unsigned char) 'R')    // Plain byte stream
+#define READBACK_BLOCK ((unsigned char) 'B')  // Page sized chunks with a CRC
+#define READBACK_COMPRESSED ((unsigned char) 'C')  // Run length encoded chunks
+
+// A readback request is the password, then the mode byte with the start
+// address and the size, in 8 byte blocks encrypted with SIMON and followed by
+// the SHA256 of that ciphertext (host_tools/readback)
+#define RB_PASSWORD_BYTES 32
+#define RB_REQUEST_BYTES (RB_PASSWORD_BYTES + 16)
+
+// Run length encoding used by READBACK_COMPRESSED, one control byte per op
+#define RLE_MAX_LITERAL 128  // 0x00-0x7F: count - 1, then the bytes
+#define RLE_MIN_RUN 3        // 0x80-0xFE: 0x80 + count - 3, then the byte
+#define RLE_MAX_RUN 129
+#define RLE_LONG_RUN ((unsigned char) 0xFF)  // 2 byte count, then the byte
+
+typedef struct {
+    uint32_t start;   // Address the first op in data expands to
+    uint32_t end;     // Address after the last op in data
+    uint16_t length;  // Encoded bytes in data
+    unsigned char data[SPM_PAGESIZE];
+    uint8_t literal_count;
+    unsigned char literal[RLE_MAX_LITERAL + 1];  // Control byte, then the bytes
+    uint16_t run;
+    unsigned char run_byte;
+} rle_state_t;
+
+// Hashes a page's ciphertext a block at a time in the background as frames
+// arrive, so only the last partial block is left when the tag comes in
+typedef struct {
+    sha256_ctx_t ctx;
+    uint8_t *data;
+    uint16_t hashed;    // Bytes already folded into ctx
+    uint16_t received;  // Bytes of the page received so far
+} page_hash_t;
+
+// Hashes programmed flash in the background for the next FRAME_TAG
+typedef struct {
+    sha256_ctx_t ctx;
+    uint32_t next;  // Next flash address to fold into ctx
+    uint32_t end;   // Flash programmed so far
+} group_hash_t;
+
+// Erases the page being received in the background while its frames arrive
+typedef struct {
+    uint32_t page;
+    uint8_t state;
+} page_erase_t;
+
+#define ERASE_START 0
+#define ERASE_BUSY 1
+#define ERASE_DONE 2
+
+// Pages between journal writes, keeps EEPROM wear down to a few writes per update
+#define JOURNAL_INTERVAL 8
+
+// Broadcast updates, see broadcast_update(). Packets from the host start with
+// BCAST_SYNC and a 2 byte sequence number, either a page number or one of the
+// control values below. Replies to a poll start with BCAST_REPLY_SYNC.
+#define BCAST_SYNC ((unsigned char) 0xB5)
+#define BCAST_REPLY_SYNC ((unsigned char) 0xB6)
+#define BCAST_START 0xFFFC  // Metadata and version hash
+#define BCAST_DONE 0xFFFD   // Everyone waits for the watchdog
+#define BCAST_POLL 0xFFFE   // Followed by the 4 byte id of the device to answer
+#define BCAST_END 0xFFFF    // Image end and the image tag
+#define BCAST_RECEIVING ((uint8_t) 0x02)  // Status while pages are missing
+#define BCAST_IDLE_MS 10000  // Silence on the bus before giving up
+#define BCAST_BITMAP_BYTES ((MANIFEST_PAGES + 7) / 8)
+
+/*
+ * Statically planned scratch RAM. An update, a broadcast update, a readback
+ * and a slot swap never run at the same time, so their page sized buffers
+ * share one union instead of each being a stack frame of its own. The round
+ * keys outlive the hand over from load_firmware() to broadcast_update() and
+ * stay outside the union. Like the rest of .bss nothing here is cleared at
+ * startup, each phase sets up what it uses.
+ */
+typedef struct {
+    uint8_t round_keys[176];
+    union {
+        struct {
+            unsigned char data[SPM_PAGESIZE];      // Page ciphertext as it arrives
+            unsigned char page_buf[SPM_PAGESIZE];  // Page rebuilt from a patch record
+        } update;
+        struct {
+            unsigned char data[SPM_PAGESIZE];
+            uint8_t received[BCAST_BITMAP_BYTES];
+        } broadcast;
+        struct {
+            unsigned char block[SPM_PAGESIZE];
+            rle_state_t rle;
+        } readback;
+        unsigned char copy[SPM_PAGESIZE];  // copy_page()
+    } phase;
+} scratch_t;
+
+static scratch_t scratch;
 
 void test_encryption(void);
+void wait_for_reset(void) __attribute__ ((noreturn));
 void program_flash(uint32_t page_address, unsigned char *data);
-void load_firmware(void);
-void boot_firmware(void);
-void readback(void);
+void program_flash_decrypt(uint32_t page_address, unsigned char *data, uint16_t length, uint8_t *round_keys);
+void load_firmware(void) __attribute__ ((noreturn));
+void boot_firmware(void) __attribute__ ((noreturn));
+void readback(void) __attribute__ ((noreturn));
+void readback_blocks(uint32_t addr, uint32_t size);
+void readback_compressed(uint32_t addr, uint32_t size);
+void readback_chunk(uint32_t addr, unsigned char *data, uint16_t length);
+uint16_t readback_putchar(unsigned char data, uint16_t crc);
+void rle_put(rle_state_t *rle, unsigned char byte);
+void rle_end_run(rle_state_t *rle);
+void rle_end_literal(rle_state_t *rle);
+void rle_append(rle_state_t *rle, unsigned char *op, uint16_t op_length, uint16_t expands_to);
 int cmp(uint8_t *, uint8_t *, int);
+unsigned char frame_read(unsigned char *dest, uint16_t length, uint16_t *crc);
+unsigned char frame_check(uint16_t crc);
+void frame_nak(uint32_t page_address);
+uint8_t page_hash_step(void *arg);
+uint8_t page_erase_step(void *arg);
+uint8_t group_hash_step(void *arg);
+void send_capabilities(void);
+void send_stats(void);
+void hash_flash(uint8_t *dest, uint32_t start_addr, uint32_t length);
+void page_digest(uint8_t *dest, uint32_t page_address);
+#if MANIFEST_CACHE
+void cache_digest(uint32_t page_address);
+#endif
+void send_manifest(void);
+void send_journal(void);
+void journal_progress(uint32_t page_address);
+void erase_page(uint32_t page_address);
+#if DUAL_SLOT
+void request_swap(uint32_t new_size);
+void swap_slots(void);
+void copy_page(uint32_t dest, uint32_t src);
+void rollback(void);
+#endif
+void finish_update(uint32_t image_end, uint32_t size, uint8_t *round_keys);
+unsigned char start_update(uint16_t version, uint32_t size, uint32_t bundle,
+                           uint8_t *sig, uint8_t *key);
+unsigned char check_image(uint32_t image_end, uint8_t *image_tag, uint32_t size,
+                          uint8_t *round_keys);
+void broadcast_update(uint8_t *key, uint8_t *round_keys) __attribute__ ((noreturn));
+void broadcast_reply(uint8_t status, uint8_t *received, uint32_t image_end);
+unsigned char apply_patch(uint8_t *record, uint16_t length, uint8_t *page_buf);
+uint8_t hex_digit(char c);
 
-uint16_t fw_size EEMEM = 0;
+uint32_t fw_size EEMEM = 0;  // 32 bits so images can use all 120 KB
 uint16_t fw_version EEMEM = 0;
+uint32_t journal_bundle EEMEM = 0;  // Bundle id of the last update started
+uint16_t journal_page EEMEM = 0;  // Pages of that bundle known to be written
+uint32_t device_id EEMEM = DEVICE_ID;  // Answers broadcast polls for this id
+#if DUAL_SLOT
+// Swapping the slots is resumable: swap_page and swap_step are single bytes
+// so every change of state is one EEPROM byte write, and each step copies
+// from a page that stays intact until the step after it.
+#define SWAP_IDLE ((uint8_t) 0x00)
+#define SWAP_PENDING ((uint8_t) 0x5A)
+#define SWAP_TO_SCRATCH 0  // Running page to the scratch page
+#define SWAP_TO_RUNNING 1  // Staging page to the running page
+#define SWAP_TO_STAGING 2  // Scratch page to the staging page
+#define SWAP_PARITY 0x80   // swap_step holds the low bit of the page it is for
+
+uint32_t staged_size EEMEM = 0;  // Image in the staging slot, 0 if there is none
+uint8_t swap_state EEMEM = SWAP_IDLE;
+uint8_t swap_page EEMEM = 0;
+uint8_t swap_step EEMEM = 0;
+uint32_t swap_new_size EEMEM = 0;  // fw_size once the swap is done
+uint32_t swap_old_size EEMEM = 0;  // staged_size once the swap is done
+#endif
+#if MANIFEST_CACHE
+// All zero means the digest has not been cached yet
+uint8_t digest_cache[MANIFEST_PAGES][DIGEST_SIZE] EEMEM;
+#endif
+
+// The 64 hex digit password bl_build generates, kept out of RAM. It is in
+// the boot section above 64 KB, so it is read with memcpy_PF().
+static const char rb_password[] PROGMEM = RB_PASSWORD;
+_Static_assert(sizeof(rb_password) == 2 * RB_PASSWORD_BYTES + 1,
+               "PASSWORD must be 64 hex digits");
 
 int main(void) {
+    stats_init();  // Before anything can reach wait_for_reset()
+
+#if FAST_BOOT
+    // Decide on the application before setting anything else up
+    DDRB &= ~((1 << PB2) | (1 << PB3));
+    PORTB |= (1 << PB2) | (1 << PB3);
+    if (!mailbox_pending()) {
+        _delay_us(PIN_SETTLE_US);
+        if ((PINB & ((1 << PB2) | (1 << PB3))) == ((1 << PB2) | (1 << PB3))) {
+            boot_firmware();
+        }
+    }
+#endif
+
     UART1_init();  // Init UART1 (virtual com port)
+    uint8_t request = mailbox_take();  // Before the pins, may change the baud rate
     UART0_init();  // Init UART0
+    trace_init();  // Debug records go out on UART0 from its UDRE interrupt
+    sched_init();
+    PROFILE_INIT();
+    sei();
     wdt_reset();
 
     DDRB &= ~((1 << PB2) | (1 << PB3));  // Configure Port B Pins 2 and 3 as inputs
     PORTB |= (1 << PB2) | (1 << PB3);  // Enable pullups - give port time to settle
 
-    // If jumper is present on pin 2, load new firmware
-    if (!(PINB & (1 << PB2))) {
+    // If the application asked for an update or jumper is present on pin 2,
+    // load new firmware
+    if (request == MAILBOX_UPDATE || !(PINB & (1 << PB2))) {
+        stack_paint();  // wait_for_reset() reports how much of it was used
         load_firmware();
     }
     else if (!(PINB & (1 << PB3))) {
         UART1_putchar('R');
+        stack_paint();
+        stats_begin(STATS_READBACK);
         readback();
     }
     else {
@@ -92,72 +410,364 @@ void test_encryption(void)
 
     //SHA256
     uint8_t dest[32] = {0};
-    uint8_t sha_data[64];  
     uint32_t length = 512;  
     uint8_t input_data[64] = {0};
     sha256(dest, input_data, length);
 }
 
+/*
+ * Sleep until the watchdog resets the chip. Interrupts still wake the CPU,
+ * so queued trace records and UART1 output finish going out first.
+ */
+void wait_for_reset(void) {
+    stats_end();
+    stack_report();
+    PROFILE_REPORT();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    while (1) {
+        sleep_cpu();
+    }
+}
+
+// Value of one digit of RB_PASSWORD
+uint8_t hex_digit(char c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
 /*
  * Interface with host readback tool.
  */
 void readback(void) {
+    unsigned char *request = scratch.phase.readback.block;  // Free until a mode runs
+    uint8_t *round_keys = scratch.round_keys;
+    uint8_t key[16] = {0};
+    uint8_t hash[32];
+    uint8_t mismatch = 0;
+
     wdt_enable(WDTO_2S);  // Start the Watchdog Timer
 
-    // Read in start address (4 bytes)
-    uint32_t start_addr = ((uint32_t)UART1_getchar()) << 24;
-    start_addr |= ((uint32_t)UART1_getchar()) << 16;
-    start_addr |= ((uint32_t)UART1_getchar()) << 8;
-    start_addr |= ((uint32_t)UART1_getchar());
+    for (uint8_t i = 0; i < RB_REQUEST_BYTES + sizeof(hash); i++) {
+        request[i] = UART1_getchar();
+    }
     wdt_reset();
 
-    // Read in size (4 bytes)
-    uint32_t size = ((uint32_t)UART1_getchar()) << 24;
-    size |= ((uint32_t)UART1_getchar()) << 16;
-    size |= ((uint32_t)UART1_getchar()) << 8;
-    size |= ((uint32_t)UART1_getchar());
+    sha256(hash, request, RB_REQUEST_BYTES * 8);
+    RunEncryptionKeySchedule(key, round_keys);
+    for (uint8_t i = 0; i < RB_REQUEST_BYTES; i += 8) {
+        Decrypt(request + i, round_keys);
+    }
     wdt_reset();
 
-    // Read the memory out to UART1
-    for (uint32_t addr = start_addr; addr < start_addr + size; ++addr) {
-        unsigned char byte = pgm_read_byte_far(addr);  // Read a byte from flash
+    // Look at every byte, so the time taken does not show where a guess went wrong
+    for (uint8_t i = 0; i < sizeof(hash); i++) {
+        mismatch |= hash[i] ^ request[RB_REQUEST_BYTES + i];
+    }
+    for (uint8_t i = 0; i < RB_PASSWORD_BYTES; i++) {
+        char digits[2];
+        memcpy_PF(digits, pgm_get_far_address(rb_password) + 2 * i, sizeof(digits));
+        mismatch |= ((hex_digit(digits[0]) << 4) | hex_digit(digits[1])) ^ request[i];
+    }
+    if (mismatch) {
+        wait_for_reset();  // No answer, the host times out
+    }
+
+    // Mode, 3 bytes of 0 and the start address, then the size zero extended
+    unsigned char mode = request[RB_PASSWORD_BYTES];
+    uint32_t start_addr = ((uint32_t) request[RB_PASSWORD_BYTES + 4]) << 24;
+    start_addr |= ((uint32_t) request[RB_PASSWORD_BYTES + 5]) << 16;
+    start_addr |= ((uint32_t) request[RB_PASSWORD_BYTES + 6]) << 8;
+    start_addr |= request[RB_PASSWORD_BYTES + 7];
+    uint32_t size = ((uint32_t) request[RB_PASSWORD_BYTES + 12]) << 24;
+    size |= ((uint32_t) request[RB_PASSWORD_BYTES + 13]) << 16;
+    size |= ((uint32_t) request[RB_PASSWORD_BYTES + 14]) << 8;
+    size |= request[RB_PASSWORD_BYTES + 15];
+
+    if (mode == READBACK_BLOCK) {
+        readback_blocks(start_addr, size);
+    }
+    else if (mode == READBACK_COMPRESSED) {
+        readback_compressed(start_addr, size);
+    }
+    else if (mode == READBACK_RAW) {
+        unsigned char block[SHA256_BLOCK_BYTES];
+
+        // Read the memory out to UART1
+        for (uint32_t addr = start_addr; addr < start_addr + size; addr += sizeof(block)) {
+            uint16_t length = sizeof(block);
+            if (start_addr + size - addr < length) {
+                length = start_addr + size - addr;
+            }
+            flash_read_block(addr, block, length);
+            wdt_reset();
+
+            for (uint16_t i = 0; i < length; i++) {
+                UART1_putchar(block[i]);  // Write the byte to UART1
+            }
+            wdt_reset();
+        }
+    }
+
+    wait_for_reset();  // Wait for watchdog timer to reset.
+}
+
+/*
+ * Send flash from addr to addr + size as chunks:
+ *
+ * [ 0x04 ]   [ 0x02 ]   [ variable ]  [ 0x02 ]
+ * --------------------------------------------
+ * | Address | Length |   Data...   |   CRC   |
+ *
+ * Chunks end at page boundaries so each one is read in a single ELPM burst,
+ * and a chunk with length 0 ends the dump. The CRC is CRC-16/XMODEM over the
+ * address, length and data. Bytes are queued on the UART1 transmit ring, so
+ * the next page is read while the current one is still shifting out.
+ */
+void readback_blocks(uint32_t addr, uint32_t size) {
+    unsigned char *block = scratch.phase.readback.block;
+    uint32_t end = addr + size;
+    uint16_t length;
+
+    do {
+        length = SPM_PAGESIZE - (addr & (SPM_PAGESIZE - 1));
+        if (end - addr < length) {
+            length = end - addr;
+        }
+        flash_read_block(addr, block, length);
         wdt_reset();
 
-        UART1_putchar(byte);  // Write the byte to UART1 
+        readback_chunk(addr, block, length);
+        addr += length;
+    } while (length != 0);
+
+    UART1_drain();
+}
+
+/*
+ * Same framing as readback_blocks(), but the data of each chunk is run
+ * length encoded and the address is where its first op expands to. Ops are
+ * buffered until a page worth of encoded bytes is ready, so a long run of
+ * erased or zero flash costs a few bytes on the wire instead of a chunk per
+ * page, and the time taken follows the real content rather than the range.
+ *
+ * Literal:  [ count - 1 (0x00-0x7F) ] [ bytes... ]
+ * Run:      [ 0x80 + count - 3 ] [ byte ]
+ * Long run: [ 0xFF ] [ count (2 bytes) ] [ byte ]
+ */
+void readback_compressed(uint32_t addr, uint32_t size) {
+    unsigned char *block = scratch.phase.readback.block;
+    rle_state_t *rle = &scratch.phase.readback.rle;
+    uint32_t end = addr + size;
+    uint16_t length;
+
+    rle->start = addr;
+    rle->end = addr;
+    rle->length = 0;
+    rle->literal_count = 0;
+    rle->run = 0;
+
+    while (addr < end) {
+        length = SPM_PAGESIZE - (addr & (SPM_PAGESIZE - 1));
+        if (end - addr < length) {
+            length = end - addr;
+        }
+        flash_read_block(addr, block, length);
         wdt_reset();
+
+        for (uint16_t i = 0; i < length; ++i) {
+            rle_put(rle, block[i]);
+        }
+        addr += length;
+    }
+
+    rle_end_run(rle);
+    rle_end_literal(rle);
+    if (rle->length != 0) {
+        readback_chunk(rle->start, rle->data, rle->length);
+    }
+    readback_chunk(end, rle->data, 0);
+
+    UART1_drain();
+}
+
+/*
+ * Queue one chunk: address, length, data and the CRC of all three.
+ */
+void readback_chunk(uint32_t addr, unsigned char *data, uint16_t length) {
+    uint16_t crc = 0;
+
+    crc = readback_putchar((unsigned char)(addr >> 24), crc);
+    crc = readback_putchar((unsigned char)(addr >> 16), crc);
+    crc = readback_putchar((unsigned char)(addr >> 8), crc);
+    crc = readback_putchar((unsigned char) addr, crc);
+    crc = readback_putchar((unsigned char)(length >> 8), crc);
+    crc = readback_putchar((unsigned char) length, crc);
+    for (uint16_t i = 0; i < length; ++i) {
+        crc = readback_putchar(data[i], crc);
+    }
+    UART1_putchar_buffered((unsigned char)(crc >> 8));
+    UART1_putchar_buffered((unsigned char) crc);
+}
+
+/*
+ * Queue a readback byte and fold it into the chunk CRC.
+ */
+uint16_t readback_putchar(unsigned char data, uint16_t crc) {
+    UART1_putchar_buffered(data);
+    return _crc_xmodem_update(crc, data);
+}
+
+/*
+ * Feed one flash byte to the encoder.
+ */
+void rle_put(rle_state_t *rle, unsigned char byte) {
+    if (rle->run != 0 && byte == rle->run_byte && rle->run != 0xFFFF) {
+        rle->run++;
+        return;
     }
+    rle_end_run(rle);
+    rle->run_byte = byte;
+    rle->run = 1;
+}
 
-    while(1) __asm__ __volatile__("");  // Wait for watchdog timer to reset.
+/*
+ * Emit the current run as a run op, or add it to the literal if it is too
+ * short to be worth one.
+ */
+void rle_end_run(rle_state_t *rle) {
+    unsigned char op[4];
+
+    if (rle->run >= RLE_MIN_RUN) {
+        rle_end_literal(rle);
+        if (rle->run <= RLE_MAX_RUN) {
+            op[0] = 0x80 + (rle->run - RLE_MIN_RUN);
+            op[1] = rle->run_byte;
+            rle_append(rle, op, 2, rle->run);
+        }
+        else {
+            op[0] = RLE_LONG_RUN;
+            op[1] = (unsigned char)(rle->run >> 8);
+            op[2] = (unsigned char) rle->run;
+            op[3] = rle->run_byte;
+            rle_append(rle, op, 4, rle->run);
+        }
+    }
+    else {
+        for (uint16_t i = 0; i < rle->run; ++i) {
+            rle->literal[1 + rle->literal_count] = rle->run_byte;
+            rle->literal_count++;
+            if (rle->literal_count == RLE_MAX_LITERAL) {
+                rle_end_literal(rle);
+            }
+        }
+    }
+    rle->run = 0;
+}
+
+/*
+ * Emit the pending literal bytes, if there are any.
+ */
+void rle_end_literal(rle_state_t *rle) {
+    if (rle->literal_count == 0) {
+        return;
+    }
+    rle->literal[0] = rle->literal_count - 1;
+    rle_append(rle, rle->literal, rle->literal_count + 1, rle->literal_count);
+    rle->literal_count = 0;
+}
+
+/*
+ * Add an op to the chunk being built, sending the chunk first if the op
+ * would not fit.
+ */
+void rle_append(rle_state_t *rle, unsigned char *op, uint16_t op_length, uint16_t expands_to) {
+    if (rle->length + op_length > SPM_PAGESIZE) {
+        readback_chunk(rle->start, rle->data, rle->length);
+        rle->start = rle->end;
+        rle->length = 0;
+    }
+    memcpy(rle->data + rle->length, op, op_length);
+    rle->length += op_length;
+    rle->end += expands_to;
 }
 
 /*
  * Load the firmware into flash.
  */
 void load_firmware(void) {
-    int frame_length = 0;
-    int frame_length_R = 0;
+    uint16_t frame_length = 0;
     unsigned char rcv = 0;
-    unsigned char data[SPM_PAGESIZE];  // SPM_PAGESIZE is the size of a page
+    unsigned char *data = scratch.phase.update.data;
+    unsigned char *page_buf = scratch.phase.update.page_buf;
+    uint16_t page_length = SPM_PAGESIZE;  // Bytes expected for the current page
     unsigned int data_index = 0;
-    unsigned int page = 0;
+    uint32_t page = 0;  // Byte address, pages above 64 KB need all 32 bits
     uint16_t version = 0;
-    uint16_t size = 0;
+    uint32_t size = 0;
+    uint32_t bundle = 0;
+    uint32_t address = 0;
     uint8_t key[16] = {0};
-    uint8_t round_keys[176] = {0};
+    uint8_t *round_keys = scratch.round_keys;
     uint8_t sig[32] = {0};
     uint8_t page_hash[32] = {0};
     unsigned int sig_index = 0;
-    uint32_t hash_length = 0;
+    page_hash_t hash_task;
+    page_erase_t erase_task;
+    group_hash_t group_task;
     uint8_t max_segments = 0;
-    uint16_t segment_index = 0;
+    uint16_t crc = 0;
+    unsigned char header[4];
+    uint8_t tag_span = 1;  // Pages per tag, 0 for the image tag only
+    uint8_t tag_len = 32;
+    uint8_t unverified = 0;  // Pages programmed since the last FRAME_TAG
+    uint16_t journal_at = 0;  // Last page count journaled at a FRAME_TAG
+    uint32_t nak_page = APP_SECTION_END;  // Address of the last NAK, none yet
+    uint8_t naks = 0;  // NAKs in a row for nak_page
     RunEncryptionKeySchedule(key, round_keys);
 
+    hash_task.data = data;
+    hash_task.hashed = 0;
+    hash_task.received = 0;
+    sha256_init(&hash_task.ctx);
+    erase_task.page = APP_SECTION_END;  // No page yet
+    erase_task.state = ERASE_DONE;
+
     wdt_enable(WDTO_2S);  // Start the Watchdog Timer
 
     UART1_putchar('U');
 
-    while(!UART1_data_available()) {  // Wait for data
-        __asm__ __volatile__("");
+    // Serve manifest requests until the host starts the update
+    while (1) {
+        rcv = UART1_getchar();  // Sleeps until the host sends a command
+        wdt_reset();
+        if (rcv == CMD_UPDATE) {
+            stats_begin(STATS_UPDATE);
+            break;
+        }
+        else if (rcv == CMD_MANIFEST) {
+            send_manifest();
+        }
+        else if (rcv == CMD_JOURNAL) {
+            send_journal();
+        }
+#if DUAL_SLOT
+        else if (rcv == CMD_ROLLBACK) {
+            rollback();
+        }
+#endif
+        else if (rcv == CMD_BROADCAST) {
+            stats_begin(STATS_UPDATE);
+            broadcast_update(key, round_keys);
+        }
+        else if (rcv == CMD_CAPABILITIES) {
+            send_capabilities();
+        }
+        else if (rcv == CMD_STATS) {
+            send_stats();
+        }
+        else {
+            UART1_putchar(ERROR);
+        }
     }
 
     // Get the version
@@ -166,11 +776,19 @@ void load_firmware(void) {
     rcv = UART1_getchar();
     version |= (uint16_t)rcv;
 
-    // Get the size
-    rcv = UART1_getchar();
-    size = (uint16_t)rcv << 8;
-    rcv = UART1_getchar();
-    size |= (uint16_t)rcv;
+    // Get the size (4 bytes)
+    for (int i = 0; i < 4; i++) {
+        size = (size << 8) | UART1_getchar();
+    }
+
+    // Get the bundle id
+    for (int i = 0; i < 4; i++) {
+        bundle = (bundle << 8) | UART1_getchar();
+    }
+
+    // How the pages are authenticated
+    tag_span = UART1_getchar();
+    tag_len = UART1_getchar();
 
     UART1_putchar(OK);
 
@@ -183,6 +801,294 @@ void load_firmware(void) {
 	sig_index++;
     }
 
+    if (tag_len < TAG_MIN_LEN || tag_len > 32 || tag_span > TAG_MAX_SPAN
+        || (tag_span == 0 && !DUAL_SLOT)
+        || start_update(version, size, bundle, sig, key) != OK) {
+        UART1_putchar(ERROR);  // Reject the metadata
+
+        wait_for_reset();  // Wait for watchdog timer to reset
+    }
+    sha256_init(&group_task.ctx);
+    group_task.next = STAGING_BASE;
+    group_task.end = STAGING_BASE;
+    UART1_putchar(OK);  // Acknowledge the metadata
+
+    data_index = 0;
+    uint8_t frame_counter = 0;
+    while (1) {  // Loop here until you can get all your characters
+        wdt_reset();
+        if (data_index == 0) {
+            PROFILE_START(PROF_PAGE);  // Restarted until a page's first frame
+        }
+        // Get two bytes for the length.
+        crc = 0;
+        if (frame_read(header, 2, &crc) != OK) {
+            goto resync;
+        }
+        frame_length = ((uint16_t)header[0] << 8) | header[1];
+
+        TRACE_DEBUG(TRACE_FRAME, frame_length);
+        wdt_reset();
+
+        // Page is already up to date, leave it in flash
+        if (frame_length == FRAME_SKIP) {
+            if (frame_check(crc) != OK) {
+                goto resync;
+            }
+            if (data_index != 0 || page >= IMAGE_END) {
+                UART1_putchar(ERROR);
+                wait_for_reset();  // Skips are only allowed on a page boundary
+            }
+            TRACE_DEBUG(TRACE_SKIP, page);
+            page += SPM_PAGESIZE;
+            if (tag_span == 1) {
+                journal_progress(page);
+            }
+            else if (tag_span > 1) {
+                group_task.end = STAGING_BASE + page;
+                sched_post(group_hash_step, &group_task);
+            }
+            UART1_putchar(OK);
+            continue;
+        }
+
+        // Next page arrives as a patch record of the given length
+        if (frame_length == FRAME_PATCH) {
+            if (frame_read(header, 2, &crc) != OK || frame_check(crc) != OK) {
+                goto resync;
+            }
+            page_length = ((uint16_t)header[0] << 8) | header[1];
+            if (data_index != 0 || page_length == 0 || page_length > SPM_PAGESIZE
+                || (page_length & 0x0F) != 0) {
+                UART1_putchar(ERROR);
+                wait_for_reset();
+            }
+            TRACE_DEBUG(TRACE_PATCH, page_length);
+            UART1_putchar(OK);
+            continue;
+        }
+
+        // Next page in the image is further ahead, blank the gap
+        if (frame_length == FRAME_ADDRESS) {
+            if (frame_read(header, 4, &crc) != OK || frame_check(crc) != OK) {
+                goto resync;
+            }
+            address = 0;
+            for (int i = 0; i < 4; i++) {
+                address = (address << 8) | header[i];
+            }
+            if (data_index != 0 || page_length != SPM_PAGESIZE || address < page
+                || (address % SPM_PAGESIZE) != 0 || address >= IMAGE_END) {
+                UART1_putchar(ERROR);
+                wait_for_reset();
+            }
+            while (page < address) {
+                erase_page(STAGING_BASE + page);
+                page += SPM_PAGESIZE;
+            }
+            if (tag_span > 1) {
+                group_task.end = STAGING_BASE + page;
+                sched_post(group_hash_step, &group_task);
+            }
+            TRACE_DEBUG(TRACE_ADDRESS, address);
+            UART1_putchar(OK);
+            continue;
+        }
+
+        // Check the flash written since the last tag
+        if (frame_length == FRAME_TAG) {
+            if (frame_read(sig, tag_len, &crc) != OK || frame_check(crc) != OK) {
+                goto resync;
+            }
+            if (data_index != 0 || page_length != SPM_PAGESIZE || tag_span <= 1) {
+                UART1_putchar(ERROR);
+                wait_for_reset();
+            }
+            sched_finish(group_hash_step, &group_task);
+            PROFILE_START(PROF_HASH);
+            sha256_lastBlock(&group_task.ctx, data, 0);
+            sha256_ctx2hash(page_hash, &group_task.ctx);
+            PROFILE_STOP(PROF_HASH);
+            wdt_reset();
+            PROFILE_START(PROF_TAG);
+            Encrypt(page_hash, round_keys);
+            Encrypt(page_hash+8, round_keys);
+            Encrypt(page_hash+16, round_keys);
+            Encrypt(page_hash+24, round_keys);
+            PROFILE_STOP(PROF_TAG);
+            if (cmp(page_hash, sig, (int) tag_len) != 0) {
+                TRACE_ERROR(TRACE_AUTH_FAIL, page);
+                stats_result(STATS_AUTH_FAIL);
+                wait_for_reset();
+            }
+            sha256_init(&group_task.ctx);
+            unverified = 0;
+
+            // Only checked pages are journaled, at most every JOURNAL_INTERVAL
+            if (page / SPM_PAGESIZE >= journal_at + JOURNAL_INTERVAL) {
+                journal_at = page / SPM_PAGESIZE;
+                eeprom_update_word(&journal_page, journal_at);
+                wdt_reset();
+            }
+            UART1_putchar(OK);
+            continue;
+        }
+
+        // Frame would overrun the page buffer, most likely a corrupted length
+        if (data_index + frame_length > page_length) {
+            goto resync;
+        }
+
+        // Get the number of bytes specified
+        if (frame_read(data + data_index, frame_length, &crc) != OK
+            || frame_check(crc) != OK) {
+            goto resync;
+        }
+        if (data_index == 0) {  // First frame of a page
+            if (frame_length != 0 && page >= IMAGE_END) {
+                UART1_putchar(ERROR);
+                wait_for_reset();  // The image does not fit
+            }
+            if (frame_length != 0 && tag_span > 1 && unverified >= tag_span) {
+                UART1_putchar(ERROR);
+                wait_for_reset();  // The host owes a FRAME_TAG
+            }
+            sha256_init(&hash_task.ctx);
+            hash_task.hashed = 0;
+            // Patched pages copy from the old page, it has to stay until then
+            if (page_length == SPM_PAGESIZE && frame_length != 0
+                && !sched_pending(page_erase_step, &erase_task)) {
+                erase_task.page = STAGING_BASE + page;
+                erase_task.state = ERASE_START;
+                sched_post(page_erase_step, &erase_task);
+            }
+        }
+        data_index += frame_length;
+        hash_task.received = data_index;
+        if (tag_span == 1) {
+            sched_post(page_hash_step, &hash_task);
+        }
+    	frame_counter++;
+	
+        // If we filed our page buffer, program it
+        if(data_index == page_length || frame_length == 0) {
+	    wdt_reset();
+
+	    if (frame_length == 0)
+		UART1_putchar('D');
+
+	    if (tag_span == 1) {
+		UART1_putchar(OK);  // Ready for the page tag, the frame OK follows it
+		crc = 0;
+		if (frame_read(sig, tag_len, &crc) != OK || frame_check(crc) != OK) {
+		    goto resync;
+		}
+
+		// Only the bytes received for this page are tagged, whole blocks
+		// have mostly been hashed while waiting for frames
+		sched_finish(page_hash_step, &hash_task);
+		PROFILE_START(PROF_HASH);
+		sha256_lastBlock(&hash_task.ctx, data + hash_task.hashed,
+				 (data_index - hash_task.hashed) << 3);
+		sha256_ctx2hash(page_hash, &hash_task.ctx);
+		PROFILE_STOP(PROF_HASH);
+		wdt_reset();
+		PROFILE_START(PROF_TAG);
+		Encrypt(page_hash,round_keys);
+		Encrypt(page_hash+8, round_keys);
+		Encrypt(page_hash+16, round_keys);
+		Encrypt(page_hash+24, round_keys);
+		PROFILE_STOP(PROF_TAG);
+		if(cmp(page_hash,sig, (int) tag_len) != 0){
+		    TRACE_ERROR(TRACE_AUTH_FAIL, page);
+		    stats_result(STATS_AUTH_FAIL);
+		    wait_for_reset();
+
+		}
+	    }
+	    wdt_reset();
+	    if (page_length != SPM_PAGESIZE) {
+		max_segments = data_index >> 3;
+		for(uint8_t i = 0; i < max_segments; i++){
+		    wdt_reset();
+		    PROFILE_START(PROF_DECRYPT);
+		    Decrypt(data + i*8, round_keys);
+		    PROFILE_STOP(PROF_DECRYPT);
+		}
+
+		// Rebuild the page from old flash and the literals in the record
+		if (frame_length == 0 || apply_patch(data, page_length, page_buf) != OK) {
+		    TRACE_ERROR(TRACE_PATCH_FAIL, page);
+		    wait_for_reset();
+		}
+		program_flash(STAGING_BASE + page, page_buf);
+		page_length = SPM_PAGESIZE;
+	    }
+	    else if (data_index != 0) {
+		if (erase_task.page != STAGING_BASE + page) {
+		    erase_task.page = STAGING_BASE + page;
+		    erase_task.state = ERASE_START;
+		}
+		PROFILE_START(PROF_ERASE);
+		sched_finish(page_erase_step, &erase_task);
+		PROFILE_STOP(PROF_ERASE);
+
+		// Blocks are decrypted straight into the SPM page buffer
+		program_flash_decrypt(STAGING_BASE + page, data, data_index, round_keys);
+	    }
+
+	    // The final frame may close out an empty page
+	    if (data_index != 0) {
+                page += SPM_PAGESIZE;
+                if (tag_span == 1) {
+                    journal_progress(page);
+                }
+                else if (tag_span > 1) {
+                    unverified++;
+                    group_task.end = STAGING_BASE + page;
+                    sched_post(group_hash_step, &group_task);
+                }
+            }
+            data_index = 0;
+            TRACE_INFO(TRACE_PAGE, page);
+            PROFILE_STOP(PROF_PAGE);
+            wdt_reset();
+	    frame_counter = 0;
+
+        }
+
+        UART1_putchar(OK);  // Acknowledge the frame
+
+        if (frame_length == 0) {
+            finish_update(page, size, round_keys);
+        }
+        continue;
+
+resync:
+        // Drop the partial page, the host sends it again from the start
+        frame_nak(page);
+        if (page != nak_page) {
+            nak_page = page;
+            naks = 0;
+        }
+        if (++naks > NAK_LIMIT) {
+            wait_for_reset();  // The host has gone away or the line is too bad
+        }
+        data_index = 0;
+        page_length = SPM_PAGESIZE;
+    }
+}
+
+/*
+ * Check the metadata of a new update and get ready for its pages. Returns
+ * ERROR if the version hash does not match or the image is older or too big.
+ */
+unsigned char start_update(uint16_t version, uint32_t size, uint32_t bundle,
+                           uint8_t *sig, uint8_t *key) {
+    unsigned char data[18];
+    uint8_t page_hash[32];
+    unsigned int sig_index;
+
     data[0] = version << 8;
     data[1] = version;
 
@@ -191,161 +1097,804 @@ void load_firmware(void) {
     {
 	wdt_reset();
 	data[sig_index] = key[sig_index - 2];
+	sig_index++;
     }
 
     // compare encrypted hash with received
     sha256(page_hash, (uint8_t *) data, (uint32_t) 144);
     if(cmp(page_hash, sig, (int) 32) != 0){
-	UART0_putchar('F');
-	while(1){
-	    __asm__ __volatile__("");
-	}
-	
+	TRACE_ERROR(TRACE_AUTH_FAIL, 0);
+	return ERROR;
     }
 
     // Compare to old version and abort if older (note special case for version 0)
-    if (version != 0 && version < eeprom_read_word(&fw_version)) {
-        UART1_putchar(ERROR);  // Reject the metadata
-        
-        while(1) {  // Wait for watchdog timer to reset
-            __asm__ __volatile__("");
-        }
+    if ((version != 0 && version < eeprom_read_word(&fw_version)) || size > IMAGE_END) {
+        return ERROR;
     }
     else if (version != 0) {  // Update version number in EEPROM
         wdt_reset();
         eeprom_update_word(&fw_version, version);
     }
 
-    // Write new firmware size to EEPROM
+    // Nothing is bootable until the whole image has been authenticated, the
+    // new size is written by check_image(). With two slots the running
+    // image stays, only the staging slot is about to be overwritten.
     wdt_reset();
-    eeprom_update_word(&fw_size, size);
+#if DUAL_SLOT
+    eeprom_update_dword(&staged_size, 0);
+#else
+    eeprom_update_dword(&fw_size, 0);
+    mailbox_arm(MAILBOX_UPDATE);  // Come back here until the update finishes
+#endif
     wdt_reset();
 
-    UART1_putchar(OK);  // Acknowledge the metadata
+    // A different bundle starts over, the same one keeps its progress
+    if (bundle != eeprom_read_dword(&journal_bundle)) {
+        eeprom_update_dword(&journal_bundle, bundle);
+        eeprom_update_word(&journal_page, 0);
+        wdt_reset();
+    }
 
-    data_index = 0;
-    uint8_t frame_counter = 0;
-    while (1) {  // Loop here until you can get all your characters
+    TRACE_INFO(TRACE_UPDATE, bundle);
+    return OK;
+}
+
+/*
+ * Read length bytes of a frame into dest and fold them into crc. Returns
+ * ERROR if the line goes quiet for FRAME_TIMEOUT_MS part way through.
+ */
+unsigned char frame_read(unsigned char *dest, uint16_t length, uint16_t *crc) {
+    int rcv;
+
+    PROFILE_START(PROF_RECEIVE);
+    for (uint16_t i = 0; i < length; i++) {
+        rcv = UART1_getchar_timeout(FRAME_TIMEOUT_MS);
+        if (rcv < 0) {
+            PROFILE_STOP(PROF_RECEIVE);
+            return ERROR;
+        }
+        dest[i] = (unsigned char) rcv;
+        *crc = _crc_xmodem_update(*crc, (uint8_t) rcv);
         wdt_reset();
-	frame_length_R = frame_length;
-        // Get two bytes for the length.
-        rcv = UART1_getchar();
-        frame_length = (int)rcv << 8;
-        rcv = UART1_getchar();
-        frame_length += (int)rcv;
+    }
+    PROFILE_STOP(PROF_RECEIVE);
+    return OK;
+}
 
-	
-        UART0_putchar((unsigned char)rcv);
+/*
+ * Read the CRC that ends a frame and compare it with the one computed.
+ */
+unsigned char frame_check(uint16_t crc) {
+    unsigned char received[2];
+    uint16_t unused = 0;
+
+    if (frame_read(received, 2, &unused) != OK) {
+        return ERROR;
+    }
+    if ((((uint16_t)received[0] << 8) | received[1]) != crc) {
+        return ERROR;
+    }
+    return OK;
+}
+
+/*
+ * Hash one more block of the page if a whole one has arrived. One SHA256
+ * block is the longest step the scheduler runs.
+ */
+uint8_t page_hash_step(void *arg) {
+    page_hash_t *hash = (page_hash_t *) arg;
+
+    if (hash->received - hash->hashed < SHA256_BLOCK_BYTES) {
+        return SCHED_DONE;
+    }
+    PROFILE_START(PROF_HASH);
+    sha256_nextBlock(&hash->ctx, hash->data + hash->hashed);
+    PROFILE_STOP(PROF_HASH);
+    hash->hashed += SHA256_BLOCK_BYTES;
+    return SCHED_AGAIN;
+}
+
+/*
+ * Erase a page one short step at a time instead of spinning on SPMEN. Code
+ * in the boot section keeps running while the RWW section erases, and the
+ * vectors are in the boot section too, so the UART interrupts still work.
+ */
+uint8_t page_erase_step(void *arg) {
+    page_erase_t *erase = (page_erase_t *) arg;
+
+    if (erase->state == ERASE_START) {
+        if (!eeprom_is_ready() || boot_spm_busy()) {
+            return SCHED_AGAIN;  // SPM can not start during an EEPROM write
+        }
+#if MANIFEST_CACHE
+        // Forget the old digest first, program_flash_decrypt() caches the
+        // new one, and a session that stops in between leaves it unknown
+        uint8_t *cached = digest_cache[erase->page / SPM_PAGESIZE];
+        if (eeprom_read_dword((uint32_t *) cached) != 0) {
+            eeprom_update_dword((uint32_t *) cached, 0);
+            return SCHED_AGAIN;  // Erase once the EEPROM write is done
+        }
+#endif
+        boot_page_erase(erase->page);
+        RAMPZ = 0;
+        erase->state = ERASE_BUSY;
+        return SCHED_AGAIN;
+    }
+    if (erase->state == ERASE_BUSY) {
+        if (boot_spm_busy()) {
+            return SCHED_AGAIN;
+        }
+        boot_rww_enable();
+        erase->state = ERASE_DONE;
+    }
+    return SCHED_DONE;
+}
+
+/*
+ * Fold one more block of programmed flash into the running tag hash. Waits
+ * while the RWW section is busy, it can not be read during an erase.
+ */
+uint8_t group_hash_step(void *arg) {
+    group_hash_t *group = (group_hash_t *) arg;
+    uint8_t block[SHA256_BLOCK_BYTES];
+
+    if (group->next >= group->end) {
+        return SCHED_DONE;
+    }
+    if (boot_rww_busy()) {
+        return SCHED_AGAIN;
+    }
+    flash_read_block(group->next, block, SHA256_BLOCK_BYTES);
+    PROFILE_START(PROF_HASH);
+    sha256_nextBlock(&group->ctx, block);
+    PROFILE_STOP(PROF_HASH);
+    group->next += SHA256_BLOCK_BYTES;
+    return SCHED_AGAIN;
+}
+
+/*
+ * Tell the host which tag spans it can pick: a flags byte (CAP_*), the
+ * largest span and the shortest tag, followed by OK.
+ */
+void send_capabilities(void) {
+    UART1_putchar(CAP_GROUP_TAGS | (DUAL_SLOT ? CAP_IMAGE_TAG | CAP_RUNNING_SLOT : 0));
+    UART1_putchar(TAG_MAX_SPAN);
+    UART1_putchar(TAG_MIN_LEN);
+    UART1_putchar(OK);
+}
+
+/*
+ * Send the statistics kept in EEPROM, big endian, followed by OK:
+ *
+ * [ boots 4 ][ updates 2 ][ ok 2 ][ auth fail 2 ][ image fail 2 ][ aborted 2 ]
+ * [ readbacks 2 ][ naks 4 ][ session ms 4 ][ last session ms 4 ]
+ */
+void send_stats(void) {
+    stats_t stats;
+    uint32_t values[10];
+
+    stats_load(&stats);
+    values[0] = stats_boots();
+    values[1] = stats.updates;
+    values[2] = stats.updates_ok;
+    values[3] = stats.auth_fail;
+    values[4] = stats.image_fail;
+    values[5] = stats.aborted;
+    values[6] = stats.readbacks;
+    values[7] = stats.naks;
+    values[8] = stats.session_ms;
+    values[9] = stats.last_ms;
+
+    for (uint8_t i = 0; i < 10; i++) {
+        if (i == 0 || i >= 7) {
+            UART1_putchar(values[i] >> 24);
+            UART1_putchar(values[i] >> 16);
+        }
+        UART1_putchar(values[i] >> 8);
+        UART1_putchar(values[i]);
+    }
+    UART1_putchar(OK);
+}
+
+/*
+ * Throw away whatever is left of a bad frame, then ask the host to resend
+ * from page_address.
+ */
+void frame_nak(uint32_t page_address) {
+    while (UART1_getchar_timeout(FRAME_TIMEOUT_MS) >= 0) {
         wdt_reset();
+    }
+    wdt_reset();
 
-        // Get the number of bytes specified
-        for(int i = 0; i < frame_length; ++i){
-            wdt_reset();
-            data[data_index] = UART1_getchar();
-            data_index += 1;
+    TRACE_ERROR(TRACE_NAK, page_address);
+    stats_nak();
+    UART1_putchar(NAK);
+    UART1_putchar((unsigned char)(page_address >> 24));
+    UART1_putchar((unsigned char)(page_address >> 16));
+    UART1_putchar((unsigned char)(page_address >> 8));
+    UART1_putchar((unsigned char) page_address);
+}
+
+/*
+ * Check the image tag against a hash of everything now in flash, including
+ * pages the host skipped, and only then record the new firmware size.
+ */
+void finish_update(uint32_t image_end, uint32_t size, uint8_t *round_keys) {
+    uint8_t image_tag[32];
+    uint16_t crc = 0;
+    uint8_t naks = 0;
+
+    while (frame_read(image_tag, 32, &crc) != OK || frame_check(crc) != OK) {
+        frame_nak(image_end);
+        if (++naks > NAK_LIMIT) {
+            wait_for_reset();
         }
-    	frame_counter++;
-	
-        // If we filed our page buffer, program it
-        if(data_index == SPM_PAGESIZE || frame_length == 0) {
-	    wdt_reset();
+        crc = 0;
+    }
 
-	    if (frame_length == 0)
-		UART1_putchar('D');
+    UART1_putchar(check_image(image_end, image_tag, size, round_keys));
+    wait_for_reset();  // Wait for watchdog timer to reset
+}
 
-            UART1_putchar(OK);
-	    sig_index = 0;
-	    for(int i = 0; i < 32; i++){
-	    	wdt_reset();
-		sig[sig_index] = UART1_getchar();
-		sig_index++;
-	    }
+/*
+ * Compare the image tag with the flash below image_end and, if it matches,
+ * make the image bootable. Returns OK or ERROR.
+ */
+unsigned char check_image(uint32_t image_end, uint8_t *image_tag, uint32_t size,
+                          uint8_t *round_keys) {
+    uint8_t image_hash[32];
 
-	    // last frame received
-	    if(frame_length == 0)
-	    {
-		hash_length = (frame_counter << 4) << 3;
-	    }
-	    else {
-		hash_length = 2048;
-	    }
+    PROFILE_START(PROF_IMAGE);
+    hash_flash(image_hash, STAGING_BASE, image_end);
+    wdt_reset();
+    Encrypt(image_hash, round_keys);
+    Encrypt(image_hash+8, round_keys);
+    Encrypt(image_hash+16, round_keys);
+    Encrypt(image_hash+24, round_keys);
+    PROFILE_STOP(PROF_IMAGE);
 
-	    sha256(page_hash, data, hash_length);
-            wdt_reset();
-	    Encrypt(page_hash,round_keys);
-            Encrypt(page_hash+8, round_keys);
-            Encrypt(page_hash+16, round_keys);
-	    Encrypt(page_hash+24, round_keys);
-	    if(cmp(page_hash,sig, (int) 32) != 0){
-	    	UART0_putchar('F');
-		while(1){
-		    __asm__ __volatile__("");
-		}
-		
-	    }
-	    wdt_reset();
-	    // Start at end of data in current page and fill zeros
-	    //
-	    
-	    max_segments = (frame_counter) * 2; 		
-	    for(uint8_t i = 0; i < max_segments; i++){
-		wdt_reset();
-		Decrypt(data + i*8, round_keys);
-	    }
+    if (cmp(image_hash, image_tag, (int) 32) != 0) {
+        TRACE_ERROR(TRACE_IMAGE_FAIL, image_end);
+        stats_result(STATS_IMAGE_FAIL);
+        return ERROR;
+    }
 
-	    segment_index = max_segments << 3;
-	    while (segment_index < 256)
-	    {
-		wdt_reset();
-		data[segment_index] = 0;
-		segment_index++;
-	    }
-            program_flash(page, data);
-            page += SPM_PAGESIZE;
-            data_index = 0;
-#if 1
-            // Write debugging messages to UART0.
-            UART0_putchar('P');
-            UART0_putchar(page>>8);
-            UART0_putchar(page);
+    wdt_reset();
+#if DUAL_SLOT
+    request_swap(size);  // boot_firmware() swaps it in on the next reset
+#else
+    eeprom_update_dword(&fw_size, size);
 #endif
-            wdt_reset();
-	    frame_counter = 0;
+    eeprom_update_word(&journal_page, 0);  // Nothing left to resume
+    TRACE_INFO(TRACE_IMAGE_OK, size);
+    stats_result(STATS_OK);
+    mailbox_clear();
+    return OK;
+}
+
+/*
+ * Receive an update that the host streams to every device on a shared bus
+ * at once. Nothing is acknowledged: packets with a bad CRC or tag are
+ * dropped and each page that arrives intact is programmed and marked in the
+ * received bitmap, in any order. The host then polls each device id, the
+ * device answers with its status and the bitmap, and the host sends the
+ * missing pages again. Once the end packet has arrived and every page below
+ * the image end is marked, the image tag is checked.
+ *
+ * Packets, each followed by a CRC-16/XMODEM of everything after the sync:
+ *
+ *   [ BCAST_SYNC ][ page number 2 ][ length 2 ][ ciphertext ][ tag 32 ]
+ *   [ BCAST_SYNC ][ BCAST_START ][ version 2 ][ size 4 ][ bundle 4 ][ version hash 32 ]
+ *   [ BCAST_SYNC ][ BCAST_END ][ image end 4 ][ image tag 32 ]
+ *   [ BCAST_SYNC ][ BCAST_POLL ][ device id 4 ]
+ *   [ BCAST_SYNC ][ BCAST_DONE ]
+ *
+ * A page of length 0 has no tag and is left erased.
+ */
+void broadcast_update(uint8_t *key, uint8_t *round_keys) {
+    unsigned char *data = scratch.phase.broadcast.data;
+    uint8_t tag[32];
+    uint8_t image_tag[32];
+    uint8_t page_hash[32];
+    uint8_t *received = scratch.phase.broadcast.received;
+    unsigned char header[4];
+    uint8_t started = 0;
+    uint8_t status = BCAST_RECEIVING;
+    uint32_t size = 0;
+    uint32_t image_end = 0;  // Known once the end packet has arrived
+    uint32_t page;
+    uint16_t idle = 0;
+    uint16_t seq;
+    uint16_t length;
+    uint16_t crc;
+    int rcv;
 
+    memset(received, 0, BCAST_BITMAP_BYTES);
+
+    while (1) {
+        rcv = UART1_getchar_timeout(FRAME_TIMEOUT_MS);
+        wdt_reset();
+        if (rcv < 0) {
+            if (++idle >= BCAST_IDLE_MS / FRAME_TIMEOUT_MS) {
+                wait_for_reset();  // The host has gone away
+            }
+            continue;
         }
+        if (rcv != BCAST_SYNC) {
+            continue;  // Repeated 'B's, replies from other devices or noise
+        }
+        idle = 0;
 
-        UART1_putchar(OK);  // Acknowledge the frame
+        crc = 0;
+        if (frame_read(header, 2, &crc) != OK) {
+            continue;
+        }
+        seq = ((uint16_t)header[0] << 8) | header[1];
+
+        if (seq == BCAST_START) {
+            if (frame_read(data, 42, &crc) != OK || frame_check(crc) != OK || started) {
+                continue;  // Repeated while other devices join
+            }
+            size = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16)
+                | ((uint32_t)data[4] << 8) | data[5];
+            uint32_t bundle = ((uint32_t)data[6] << 24) | ((uint32_t)data[7] << 16)
+                | ((uint32_t)data[8] << 8) | data[9];
+            if (start_update(((uint16_t)data[0] << 8) | data[1], size, bundle,
+                             data + 10, key) != OK) {
+                wait_for_reset();  // Not for this device, the poll goes unanswered
+            }
+            started = 1;
+            continue;
+        }
+        if (seq == BCAST_POLL) {
+            if (frame_read(header, 4, &crc) != OK || frame_check(crc) != OK) {
+                continue;
+            }
+            uint32_t id = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16)
+                | ((uint32_t)header[2] << 8) | header[3];
+            if (started && id == eeprom_read_dword(&device_id)) {
+                broadcast_reply(status, received, image_end);
+            }
+            continue;
+        }
+        if (seq == BCAST_DONE) {
+            if (frame_check(crc) == OK) {
+                wait_for_reset();
+            }
+            continue;
+        }
+        if (!started || status != BCAST_RECEIVING) {
+            continue;
+        }
+
+        if (seq == BCAST_END) {
+            if (frame_read(header, 4, &crc) != OK || frame_read(tag, 32, &crc) != OK
+                || frame_check(crc) != OK) {
+                continue;
+            }
+            page = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16)
+                | ((uint32_t)header[2] << 8) | header[3];
+            if (page == 0 || page > IMAGE_END || (page % SPM_PAGESIZE) != 0) {
+                continue;
+            }
+            image_end = page;
+            memcpy(image_tag, tag, 32);
+        }
+        else {
+            if (frame_read(header, 2, &crc) != OK) {
+                continue;
+            }
+            length = ((uint16_t)header[0] << 8) | header[1];
+            page = (uint32_t)seq * SPM_PAGESIZE;
+            if (length > SPM_PAGESIZE || (length % 8) != 0 || page >= IMAGE_END) {
+                continue;
+            }
+            if (frame_read(data, length, &crc) != OK
+                || (length != 0 && frame_read(tag, 32, &crc) != OK)
+                || frame_check(crc) != OK) {
+                continue;
+            }
+            if (received[seq / 8] & (1 << (seq % 8))) {
+                continue;  // Already programmed, this is a repair for another device
+            }
+
+            if (length != 0) {
+                sha256(page_hash, data, (uint32_t) length << 3);
+                wdt_reset();
+                Encrypt(page_hash, round_keys);
+                Encrypt(page_hash+8, round_keys);
+                Encrypt(page_hash+16, round_keys);
+                Encrypt(page_hash+24, round_keys);
+                if (cmp(page_hash, tag, (int) 32) != 0) {
+                    TRACE_ERROR(TRACE_AUTH_FAIL, page);
+                    continue;
+                }
+            }
+            erase_page(STAGING_BASE + page);
+            if (length != 0) {
+                program_flash_decrypt(STAGING_BASE + page, data, length, round_keys);
+            }
+            received[seq / 8] |= 1 << (seq % 8);
+            TRACE_INFO(TRACE_PAGE, page + SPM_PAGESIZE);
+        }
+
+        // Check the image as soon as the last missing piece is in
+        if (image_end != 0) {
+            uint16_t i;
+            for (i = 0; i < image_end / SPM_PAGESIZE; i++) {
+                if (!(received[i / 8] & (1 << (i % 8)))) {
+                    break;
+                }
+            }
+            if (i == image_end / SPM_PAGESIZE) {
+                status = check_image(image_end, image_tag, size, round_keys);
+            }
+        }
+    }
+}
+
+/*
+ * Answer a poll: device id, status (OK, ERROR or BCAST_RECEIVING), the length
+ * of the bitmap and the bitmap of received pages below the image end, which
+ * is empty until the end packet has arrived.
+ */
+void broadcast_reply(uint8_t status, uint8_t *received, uint32_t image_end) {
+    uint32_t id = eeprom_read_dword(&device_id);
+    uint16_t length = (image_end / SPM_PAGESIZE + 7) / 8;
+    uint16_t crc = 0;
+
+    UART1_putchar_buffered(BCAST_REPLY_SYNC);
+    crc = readback_putchar(id >> 24, crc);
+    crc = readback_putchar(id >> 16, crc);
+    crc = readback_putchar(id >> 8, crc);
+    crc = readback_putchar(id, crc);
+    crc = readback_putchar(status, crc);
+    crc = readback_putchar(length >> 8, crc);
+    crc = readback_putchar(length, crc);
+    for (uint16_t i = 0; i < length; i++) {
+        crc = readback_putchar(received[i], crc);
     }
+    UART1_putchar_buffered(crc >> 8);
+    UART1_putchar_buffered(crc);
+    UART1_drain();  // Off the bus before the host talks again
+}
+
+/*
+ * Record that every page below page_address has been written. Only every
+ * JOURNAL_INTERVAL pages is recorded, a resumed update redoes the rest.
+ */
+void journal_progress(uint32_t page_address) {
+    uint16_t page_num = page_address / SPM_PAGESIZE;
+
+    if ((page_num % JOURNAL_INTERVAL) == 0) {
+        PROFILE_START(PROF_JOURNAL);
+        eeprom_update_word(&journal_page, page_num);
+        PROFILE_STOP(PROF_JOURNAL);
+        wdt_reset();
+    }
+}
+
+/*
+ * Leave a page the image does not use erased. Pages that are already blank
+ * are not erased again.
+ */
+void erase_page(uint32_t page_address) {
+    uint8_t blank[SHA256_BLOCK_BYTES];
+
+    memset(blank, 0xFF, sizeof(blank));
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i += sizeof(blank)) {
+        if (flash_compare_block(page_address + i, blank, sizeof(blank)) != 0) {
+            boot_page_erase_safe(page_address);
+            boot_rww_enable_safe();
+#if MANIFEST_CACHE
+            // Unknown until the page is programmed or hashed on request
+            eeprom_update_dword((uint32_t *) digest_cache[page_address / SPM_PAGESIZE], 0);
+#endif
+            break;
+        }
+    }
+    wdt_reset();
+}
+
+/*
+ * Send the bundle id (4 bytes) and page count (2 bytes) of the journal,
+ * followed by OK.
+ */
+void send_journal(void) {
+    uint32_t bundle = eeprom_read_dword(&journal_bundle);
+    uint16_t page_num = eeprom_read_word(&journal_page);
+
+    UART1_putchar(bundle >> 24);
+    UART1_putchar(bundle >> 16);
+    UART1_putchar(bundle >> 8);
+    UART1_putchar(bundle);
+    UART1_putchar(page_num >> 8);
+    UART1_putchar(page_num);
+    UART1_putchar(OK);
+}
+
+/*
+ * Rebuild a page from a decrypted patch record. The record starts with the
+ * digest of the target page, followed by operations that copy bytes from the
+ * current flash, insert literal bytes or fill a run with one value. A count of
+ * zero means a whole page. Copy addresses are image offsets into the running
+ * image at 0. Without DUAL_SLOT that is where the pages are written, so the
+ * host only copies from pages that already hold their final contents or have
+ * not been rewritten yet. With DUAL_SLOT the running slot holds the base
+ * release and is not touched until the swap.
+ */
+unsigned char apply_patch(uint8_t *record, uint16_t length, uint8_t *page_buf) {
+    uint16_t in = DIGEST_SIZE;
+    uint16_t out = 0;
+    uint16_t count;
+    uint32_t src;
+    uint8_t page_hash[32];
+
+    while (in < length && record[in] != PATCH_END) {
+        wdt_reset();
+        if (record[in] == PATCH_COPY) {
+            if (in + 5 > length) {
+                return ERROR;
+            }
+            src = ((uint32_t)record[in+1] << 16) | ((uint32_t)record[in+2] << 8) | record[in+3];
+            count = record[in+4] ? record[in+4] : SPM_PAGESIZE;
+            in += 5;
+            if (out + count > SPM_PAGESIZE || src + count > IMAGE_END) {
+                return ERROR;
+            }
+            flash_read_block(src, page_buf + out, count);
+            out += count;
+        }
+        else if (record[in] == PATCH_LITERAL) {
+            if (in + 2 > length) {
+                return ERROR;
+            }
+            count = record[in+1] ? record[in+1] : SPM_PAGESIZE;
+            in += 2;
+            if (in + count > length || out + count > SPM_PAGESIZE) {
+                return ERROR;
+            }
+            memcpy(page_buf + out, record + in, count);
+            in += count;
+            out += count;
+        }
+        else if (record[in] == PATCH_FILL) {
+            if (in + 3 > length) {
+                return ERROR;
+            }
+            count = record[in+1] ? record[in+1] : SPM_PAGESIZE;
+            if (out + count > SPM_PAGESIZE) {
+                return ERROR;
+            }
+            memset(page_buf + out, record[in+2], count);
+            in += 3;
+            out += count;
+        }
+        else {
+            return ERROR;
+        }
+    }
+
+    if (out != SPM_PAGESIZE) {
+        return ERROR;
+    }
+
+    // Make sure the rebuilt page is the one the record was made for
+    sha256(page_hash, page_buf, (uint32_t)SPM_PAGESIZE << 3);
+    if (cmp(page_hash, record, DIGEST_SIZE) != 0) {
+        return ERROR;
+    }
+    return OK;
+}
+
+/*
+ * Hash length bytes of flash starting at start_addr. The length must be a
+ * multiple of the SHA256 block size.
+ */
+void hash_flash(uint8_t *dest, uint32_t start_addr, uint32_t length) {
+    sha256_ctx_t ctx;
+    uint8_t block[SHA256_BLOCK_BYTES];
+
+    sha256_init(&ctx);
+    while (length > 0) {
+        flash_read_block(start_addr, block, SHA256_BLOCK_BYTES);
+        start_addr += SHA256_BLOCK_BYTES;
+        sha256_nextBlock(&ctx, block);
+        length -= SHA256_BLOCK_BYTES;
+        wdt_reset();
+    }
+    sha256_lastBlock(&ctx, block, 0);
+    sha256_ctx2hash(dest, &ctx);
+}
+
+/*
+ * Truncated SHA256 of one page of flash, served from EEPROM when cached.
+ */
+void page_digest(uint8_t *dest, uint32_t page_address) {
+    uint8_t page_hash[32];
+
+#if MANIFEST_CACHE
+    eeprom_read_block(dest, digest_cache[page_address / SPM_PAGESIZE], DIGEST_SIZE);
+    if (dest[0] | dest[1] | dest[2] | dest[3]) {
+        return;
+    }
+#endif
+    hash_flash(page_hash, page_address, SPM_PAGESIZE);
+    memcpy(dest, page_hash, DIGEST_SIZE);
+}
+
+#if MANIFEST_CACHE
+/*
+ * Cache the digest of a page that has just been programmed. Erases clear the
+ * entry instead, so the manifest never serves the digest of what a page used
+ * to hold.
+ */
+void cache_digest(uint32_t page_address) {
+    uint8_t page_hash[32];
+
+    if (page_address < IMAGE_END) {
+        hash_flash(page_hash, page_address, SPM_PAGESIZE);
+        eeprom_update_block(page_hash, digest_cache[page_address / SPM_PAGESIZE], DIGEST_SIZE);
+    }
+}
+#endif
+
+#if DUAL_SLOT
+/*
+ * Ask boot_firmware() to swap the slots, after which the staging image of
+ * new_size bytes runs and the running image is kept in the staging slot.
+ * Writing swap_state is the single byte that commits the request.
+ */
+void request_swap(uint32_t new_size) {
+    eeprom_update_dword(&swap_new_size, new_size);
+    eeprom_update_dword(&swap_old_size, eeprom_read_dword(&fw_size));
+    eeprom_update_byte(&swap_page, 0);
+    eeprom_update_byte(&swap_step, SWAP_TO_SCRATCH);
+    wdt_reset();
+    eeprom_update_byte(&swap_state, SWAP_PENDING);
+}
+
+/*
+ * Swap the running and staging slots page by page through the scratch page,
+ * carrying on from wherever a reset interrupted the last attempt.
+ */
+void swap_slots(void) {
+    uint8_t page_num = eeprom_read_byte(&swap_page);
+    uint8_t step = eeprom_read_byte(&swap_step);
+
+    // A step left over from the previous page means this one has not started
+    if (((step & SWAP_PARITY) != 0) != (page_num & 1)) {
+        step = SWAP_TO_SCRATCH;
+    }
+    step &= ~SWAP_PARITY;
+
+    for (; page_num < SLOT_PAGES; page_num++) {
+        uint32_t running = (uint32_t)page_num * SPM_PAGESIZE;
+        uint8_t parity = (page_num & 1) ? SWAP_PARITY : 0;
+
+        if (step == SWAP_TO_SCRATCH) {
+            copy_page(SCRATCH_PAGE, running);
+            step = SWAP_TO_RUNNING;
+            eeprom_update_byte(&swap_step, parity | step);
+        }
+        if (step == SWAP_TO_RUNNING) {
+            copy_page(running, STAGING_BASE + running);
+            step = SWAP_TO_STAGING;
+            eeprom_update_byte(&swap_step, parity | step);
+        }
+        copy_page(STAGING_BASE + running, SCRATCH_PAGE);
+        eeprom_update_byte(&swap_page, page_num + 1);
+        step = SWAP_TO_SCRATCH;
+    }
+
+    eeprom_update_dword(&fw_size, eeprom_read_dword(&swap_new_size));
+    eeprom_update_dword(&staged_size, eeprom_read_dword(&swap_old_size));
+    wdt_reset();
+    eeprom_update_byte(&swap_state, SWAP_IDLE);
+}
+
+/*
+ * Program the page at dest with a copy of the page at src.
+ */
+void copy_page(uint32_t dest, uint32_t src) {
+    flash_read_block(src, scratch.phase.copy, SPM_PAGESIZE);
+    program_flash(dest, scratch.phase.copy);
+    wdt_reset();
+}
+
+/*
+ * Go back to the image in the staging slot. Nothing is downloaded, the slots
+ * are swapped on the next boot.
+ */
+void rollback(void) {
+    uint32_t size = eeprom_read_dword(&staged_size);
+
+    if (size == 0 || eeprom_read_byte(&swap_state) == SWAP_PENDING) {
+        UART1_putchar(ERROR);
+        return;
+    }
+    request_swap(size);
+    UART1_putchar(OK);
+}
+#endif
+
+/*
+ * Send the digest of the first N pages of flash. The host sends N as two
+ * bytes, the reply is DIGEST_SIZE bytes per page followed by OK. N normally
+ * counts pages of the slot an update writes to. With MANIFEST_RUNNING set it
+ * counts pages of the running image, which patch records copy from.
+ */
+void send_manifest(void) {
+    uint8_t digest[DIGEST_SIZE];
+    uint32_t base = STAGING_BASE;
+    uint16_t count = (uint16_t)UART1_getchar() << 8;
+    count |= (uint16_t)UART1_getchar();
+
+    if (count & MANIFEST_RUNNING) {
+        count &= ~MANIFEST_RUNNING;
+        base = 0;
+    }
+    if (count > MANIFEST_PAGES) {
+        UART1_putchar(ERROR);
+        return;
+    }
+
+    for (uint16_t i = 0; i < count; i++) {
+        page_digest(digest, base + (uint32_t)i * SPM_PAGESIZE);
+        for (uint8_t j = 0; j < DIGEST_SIZE; j++) {
+            UART1_putchar(digest[j]);
+        }
+        wdt_reset();
+    }
+    UART1_putchar(OK);
 }
 
 /*
  * Ensure the firmware is loaded correctly and boot it up.
  */
 void boot_firmware(void) {
+#if !FAST_BOOT
     wdt_enable(WDTO_2S);  // Start the Watchdog Timer
+#endif
 
-    // Write out the release message
-    uint8_t cur_byte;
-    uint32_t addr = (uint32_t)eeprom_read_word(&fw_size);
+#if DUAL_SLOT
+    if (eeprom_read_byte(&swap_state) == SWAP_PENDING) {
+        wdt_enable(WDTO_2S);
+        swap_slots();
+    }
+#endif
+    uint32_t addr = eeprom_read_dword(&fw_size);
 
     // Reset if firmware size is 0 (indicates no firmware is loaded)
     if(addr == 0) {
-        while(1) __asm__ __volatile__("");  // Wait for watchdog timer to reset
+        wdt_enable(WDTO_2S);
+        wait_for_reset();  // Wait for watchdog timer to reset
     }
+
+#if !FAST_BOOT
+    // FAST_BOOT skips both of these: the application prints the message
+    // itself (see bl_release_message()), and scanning the boot ring and the
+    // EEPROM write would cost more than the rest of the fast path, so
+    // boots are not counted
+    uint8_t cur_byte;
     wdt_reset();
 
     // Write out release message to UART0
+    trace_flush();
     do {
         cur_byte = pgm_read_byte_far(addr);
         UART0_putchar(cur_byte);
         ++addr;
     } while (cur_byte != 0);
 
+    stats_boot();
+#endif
+
     // Stop the Watchdog Timer
     wdt_reset();
     wdt_disable();
 
-    asm("jmp 0000");  // Perform the jmp to the firmware
+    hal_start_application();  // Vectors back to the application, then jmp 0000
 }
 /*
  * To program flash, you need to access and program it in pages
@@ -358,10 +1907,16 @@ void boot_firmware(void) {
  * 4. When you are done programming all of your pages, enable the flash
  *
  * You must fill the buffer one word at a time
+ *
+ * page_address is a full 32 bit byte address. The boot.h macros load its
+ * upper byte into RAMPZ for pages above 64 KB, RAMPZ is cleared again
+ * afterwards so code that assumes it is 0 is not surprised.
  */
 void program_flash(uint32_t page_address, unsigned char* data) {
     int i = 0;
+    PROFILE_START(PROF_ERASE);
     boot_page_erase_safe(page_address);
+    PROFILE_STOP(PROF_ERASE);
 
     for(i = 0; i < SPM_PAGESIZE; i += 2) {
         uint16_t w = data[i];  // Make a word out of two bytes
@@ -369,8 +1924,47 @@ void program_flash(uint32_t page_address, unsigned char* data) {
         boot_page_fill_safe(page_address+i, w);
     }
 
+    PROFILE_START(PROF_PROGRAM);
     boot_page_write_safe(page_address);
     boot_rww_enable_safe();  // We can just enable it after every program too
+    PROFILE_STOP(PROF_PROGRAM);
+    RAMPZ = 0;
+#if MANIFEST_CACHE
+    cache_digest(page_address);
+#endif
+}
+
+/*
+ * Decrypt length bytes of an authenticated page 8 bytes at a time and load
+ * each block into the SPM page buffer as soon as it is plaintext, so the
+ * page is only walked once. Words past length are never filled and program
+ * as 0xFF, the same as erased flash. The page must already be erased, see
+ * page_erase_step().
+ */
+void program_flash_decrypt(uint32_t page_address, unsigned char *data, uint16_t length,
+                           uint8_t *round_keys) {
+    boot_rww_enable_safe();  // Throws away anything left in the page buffer
+
+    for (uint16_t i = 0; i < length; i += 8) {
+        wdt_reset();
+        PROFILE_START(PROF_DECRYPT);
+        Decrypt(data + i, round_keys);
+        PROFILE_STOP(PROF_DECRYPT);
+        for (uint8_t j = 0; j < 8; j += 2) {
+            uint16_t w = data[i+j];  // Make a word out of two bytes
+            w += data[i+j+1] << 8;
+            boot_page_fill(page_address + i + j, w);  // SPM is idle after the enable
+        }
+    }
+
+    PROFILE_START(PROF_PROGRAM);
+    boot_page_write_safe(page_address);
+    boot_rww_enable_safe();
+    PROFILE_STOP(PROF_PROGRAM);
+    RAMPZ = 0;
+#if MANIFEST_CACHE
+    cache_digest(page_address);
+#endif
 }
 
 int cmp(uint8_t *c1, uint8_t *c2, int length)
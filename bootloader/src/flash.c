@@ -0,0 +1,54 @@
+/* Block reads from anywhere in flash */
+#include <avr/io.h>
+#include <stdint.h>
+#include "flash.h"
+
+// pgm_read_byte_far() reloads RAMPZ:Z for every byte, these loops load it
+// once and let elpm Z+ step through all 24 bits: 9 cycles a byte.
+
+void flash_read_block(uint32_t addr, uint8_t *dst, uint16_t len) {
+    uint16_t z = (uint16_t) addr;
+
+    if (len == 0) {
+        return;
+    }
+    __asm__ __volatile__
+    (
+        "out %[rampz], %[hi]            \n\t"
+        "1:                             \n\t"
+        "elpm __tmp_reg__, Z+           \n\t"
+        "st X+, __tmp_reg__             \n\t"
+        "sbiw %[len], 1                 \n\t"
+        "brne 1b                        \n\t"
+        "out %[rampz], __zero_reg__     \n\t"
+        : "+z" (z), "+x" (dst), [len] "+w" (len)
+        : [rampz] "I" (_SFR_IO_ADDR(RAMPZ)), [hi] "r" ((uint8_t)(addr >> 16))
+        : "memory"
+    );
+}
+
+uint8_t flash_compare_block(uint32_t addr, const uint8_t *src, uint16_t len) {
+    uint16_t z = (uint16_t) addr;
+    uint8_t diff;
+
+    if (len == 0) {
+        return 0;
+    }
+    __asm__ __volatile__
+    (
+        "out %[rampz], %[hi]            \n\t"
+        "1:                             \n\t"
+        "elpm %[diff], Z+               \n\t"
+        "ld __tmp_reg__, X+             \n\t"
+        "sub %[diff], __tmp_reg__       \n\t"
+        "brne 2f                        \n\t"  // Stop at the first difference
+        "sbiw %[len], 1                 \n\t"
+        "brne 1b                        \n\t"
+        "2:                             \n\t"
+        "out %[rampz], __zero_reg__     \n\t"
+        : [diff] "=&r" (diff), "+z" (z), "+x" (src), [len] "+w" (len)
+        : [rampz] "I" (_SFR_IO_ADDR(RAMPZ)), [hi] "r" ((uint8_t)(addr >> 16))
+        : "memory"
+    );
+    return diff;
+}
@@ -0,0 +1,37 @@
+/* Hardware abstraction layer, the parts that are not inline in hal.h */
+#include <stdint.h>
+#include "hal.h"
+
+// Timer3 runs from F_CPU / 1024 and overflows every 3.4 s at 20 MHz
+#define HAL_CLOCK_PRESCALE 1024UL
+
+// .bss is not cleared at startup (see sys_startup.c), hal_clock_start() resets it.
+static volatile uint16_t hal_clock_overflows;
+
+void hal_clock_start(void) {
+    hal_clock_overflows = 0;
+
+    TCCR3A = 0;
+    TCNT3 = 0;
+    TIFR3 = (1 << TOV3);
+    TIMSK3 = (1 << TOIE3);
+    TCCR3B = (1 << CS32) | (1 << CS30);  // Normal mode, F_CPU / 1024
+}
+
+uint32_t hal_clock_ms(void) {
+    uint16_t low;
+    uint16_t high;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        low = TCNT3;
+        high = hal_clock_overflows;
+        if ((TIFR3 & (1 << TOV3)) && low < 0x8000) {
+            high++;  // The overflow interrupt has not run yet
+        }
+    }
+    return (((uint32_t) high << 16) | low) / (F_CPU / HAL_CLOCK_PRESCALE / 1000);
+}
+
+ISR(TIMER3_OVF_vect) {
+    hal_clock_overflows++;
+}
@@ -0,0 +1,41 @@
+/* Application to bootloader mailbox */
+#include <stdint.h>
+#include "hal.h"
+#include "mailbox.h"
+#include "uart.h"
+
+bool mailbox_pending(void) {
+    volatile mailbox_t *mb = MAILBOX;
+
+    // __Init saves MCUSR in GPIOR0 before clearing it
+    return (GPIOR0 & (1 << WDRF)) && mb->magic == MAILBOX_MAGIC
+        && mb->check == mailbox_check(mb);
+}
+
+uint8_t mailbox_take(void) {
+    volatile mailbox_t *mb = MAILBOX;
+    uint8_t command = MAILBOX_NONE;
+
+    if (mailbox_pending()) {
+        command = mb->command;
+        if (mb->ubrr != 0) {
+            UART1_set_baud(mb->ubrr, mb->u2x);
+        }
+    }
+    mailbox_clear();
+    return command;
+}
+
+void mailbox_arm(uint8_t command) {
+    volatile mailbox_t *mb = MAILBOX;
+
+    mb->command = command;
+    mb->ubrr = UBRR1;
+    mb->u2x = UCSR1A & (1 << U2X1);
+    mb->magic = MAILBOX_MAGIC;
+    mb->check = mailbox_check(mb);
+}
+
+void mailbox_clear(void) {
+    MAILBOX->magic = 0;
+}
@@ -0,0 +1,105 @@
+/* Cycle counting profiler for the update loop */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdint.h>
+#include "profile.h"
+#include "trace.h"
+
+#if PROFILE
+
+typedef struct {
+    uint32_t total;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+} profile_phase_t;
+
+// .bss is not cleared at startup (see sys_startup.c), profile_init() resets it.
+static volatile uint16_t profile_overflows;
+static uint32_t profile_started[PROF_PHASES];
+static profile_phase_t profile_phases[PROF_PHASES];
+static uint16_t profile_overhead;  // Cycles a start and stop cost on their own
+
+static uint32_t profile_now(void) {
+    uint16_t low;
+    uint16_t high;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        low = TCNT1;
+        high = profile_overflows;
+        // Overflowed after interrupts went off, the interrupt has not run yet
+        if ((TIFR1 & (1 << TOV1)) && low < 0x8000) {
+            high++;
+        }
+    }
+    return ((uint32_t) high << 16) | low;
+}
+
+void profile_init(void) {
+    profile_overflows = 0;
+    profile_overhead = 0;
+    for (uint8_t i = 0; i < PROF_PHASES; i++) {
+        profile_phases[i].total = 0;
+        profile_phases[i].count = 0;
+        profile_phases[i].min = UINT32_MAX;
+        profile_phases[i].max = 0;
+    }
+
+    TCCR1A = 0;
+    TCNT1 = 0;
+    TIFR1 = (1 << TOV1);
+    TIMSK1 = (1 << TOIE1);
+    TCCR1B = (1 << CS10);  // Normal mode, F_CPU / 1
+
+    // Time an empty phase so it can be taken off every measurement
+    profile_start(PROF_PAGE);
+    profile_stop(PROF_PAGE);
+    profile_overhead = profile_phases[PROF_PAGE].total;
+    profile_phases[PROF_PAGE].total = 0;
+    profile_phases[PROF_PAGE].count = 0;
+    profile_phases[PROF_PAGE].min = UINT32_MAX;
+    profile_phases[PROF_PAGE].max = 0;
+}
+
+void profile_start(uint8_t phase) {
+    profile_started[phase] = profile_now();
+}
+
+void profile_stop(uint8_t phase) {
+    uint32_t cycles = profile_now() - profile_started[phase];
+    profile_phase_t *p = &profile_phases[phase];
+
+    cycles = cycles > profile_overhead ? cycles - profile_overhead : 0;
+    p->total += cycles;
+    p->count++;
+    if (cycles < p->min) {
+        p->min = cycles;
+    }
+    if (cycles > p->max) {
+        p->max = cycles;
+    }
+}
+
+void profile_report(void) {
+    trace_flush();
+    trace_record(TRACE_PROFILE, F_CPU);
+    for (uint8_t i = 0; i < PROF_PHASES; i++) {
+        profile_phase_t *p = &profile_phases[i];
+
+        if (p->count == 0) {
+            continue;
+        }
+        trace_flush();  // The whole summary does not fit in the ring at once
+        trace_record(TRACE_PROF_PHASE, ((uint32_t) i << 24) | (p->count & 0xFFFFFF));
+        trace_record(TRACE_PROF_TOTAL, p->total);
+        trace_record(TRACE_PROF_MIN, p->min);
+        trace_record(TRACE_PROF_MAX, p->max);
+    }
+}
+
+ISR(TIMER1_OVF_vect) {
+    profile_overflows++;
+}
+
+#endif
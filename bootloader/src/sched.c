@@ -0,0 +1,87 @@
+/* Run to completion background tasks */
+#include <stdint.h>
+#include "hal.h"
+#include "sched.h"
+
+typedef struct {
+    sched_step_t step;
+    void *arg;
+} sched_task_t;
+
+// .bss is not cleared at startup (see sys_startup.c), sched_init() resets it.
+static sched_task_t sched_tasks[SCHED_MAX_TASKS];
+static uint8_t sched_count;
+static uint8_t sched_next;  // Round robin position
+
+void sched_init(void) {
+    sched_count = 0;
+    sched_next = 0;
+    set_sleep_mode(SLEEP_MODE_IDLE);  // UARTs, timers and the watchdog keep running
+}
+
+uint8_t sched_pending(sched_step_t step, void *arg) {
+    for (uint8_t i = 0; i < sched_count; i++) {
+        if (sched_tasks[i].step == step && sched_tasks[i].arg == arg) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t sched_post(sched_step_t step, void *arg) {
+    if (sched_pending(step, arg)) {
+        return 1;
+    }
+    if (sched_count == SCHED_MAX_TASKS) {
+        return 0;
+    }
+    sched_tasks[sched_count].step = step;
+    sched_tasks[sched_count].arg = arg;
+    sched_count++;
+    return 1;
+}
+
+uint8_t sched_run(void) {
+    if (sched_count == 0) {
+        return 0;
+    }
+    if (sched_next >= sched_count) {
+        sched_next = 0;
+    }
+
+    uint8_t i = sched_next;
+    if (sched_tasks[i].step(sched_tasks[i].arg) == SCHED_DONE) {
+        // Keep the queue packed, the task after it moves into slot i
+        sched_count--;
+        for (; i < sched_count; i++) {
+            sched_tasks[i] = sched_tasks[i + 1];
+        }
+    }
+    else {
+        sched_next++;
+    }
+    return 1;
+}
+
+void sched_idle(bool (*ready)(void)) {
+    if (sched_run()) {
+        return;
+    }
+    cli();
+    if (!ready()) {
+        sleep_enable();
+        sei();  // The instruction after sei always runs before an interrupt
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+}
+
+void sched_finish(sched_step_t step, void *arg) {
+    while (sched_pending(step, arg)) {
+        sched_run();
+    }
+    while (step(arg) != SCHED_DONE) {
+        // Only reached if sched_post() found the queue full
+    }
+}
@@ -0,0 +1,39 @@
+/* Stack high water mark */
+#include <avr/io.h>
+#include <stdint.h>
+#include "stack.h"
+#include "trace.h"
+
+// First byte after .bss and .noinit, from the linker script
+extern uint8_t __heap_start;
+
+// GPIOR1 is 0 after every reset, unlike .bss which is never cleared
+#define STACK_PAINTED (1 << 0)
+
+void stack_paint(void) {
+    uint8_t *p = &__heap_start;
+    uint8_t *sp = (uint8_t *) SP;  // Everything above is in use
+
+    while (p < sp) {
+        *p++ = STACK_PAINT;
+    }
+    GPIOR1 |= STACK_PAINTED;
+}
+
+uint16_t stack_unused(void) {
+    uint8_t *p = &__heap_start;
+
+    if (!(GPIOR1 & STACK_PAINTED)) {
+        return 0;
+    }
+    while (p < (uint8_t *) SP && *p == STACK_PAINT) {
+        p++;
+    }
+    return p - &__heap_start;
+}
+
+void stack_report(void) {
+    if (GPIOR1 & STACK_PAINTED) {
+        TRACE_INFO(TRACE_STACK, stack_unused());
+    }
+}
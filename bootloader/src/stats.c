@@ -0,0 +1,155 @@
+/* Persistent bootloader statistics */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal.h"
+#include "stats.h"
+
+stats_t stats_slots[STATS_SLOTS] EEMEM;
+uint8_t boot_ring[STATS_BOOT_RING] EEMEM = { [0 ... STATS_BOOT_RING - 1] = 0xFF };
+
+// .bss is not cleared at startup (see sys_startup.c), stats_init() resets it.
+static uint8_t stats_session;
+static uint8_t stats_outcome;
+static uint32_t stats_naks;
+
+static uint16_t stats_crc(const stats_t *stats) {
+    const uint8_t *p = (const uint8_t *) stats;
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < offsetof(stats_t, crc); i++) {
+        crc = _crc16_update(crc, p[i]);
+    }
+    return crc;
+}
+
+uint8_t stats_load(stats_t *stats) {
+    stats_t slot;
+    uint8_t newest = STATS_SLOTS;
+
+    for (uint8_t i = 0; i < STATS_SLOTS; i++) {
+        eeprom_read_block(&slot, &stats_slots[i], sizeof(slot));
+        if (slot.crc != stats_crc(&slot)) {
+            continue;  // Never written, or torn by a reset
+        }
+        if (newest == STATS_SLOTS || (int16_t)(slot.seq - stats->seq) > 0) {
+            *stats = slot;
+            newest = i;
+        }
+    }
+    if (newest == STATS_SLOTS) {
+        memset(stats, 0, sizeof(*stats));
+        return STATS_SLOTS - 1;  // The first record goes in slot 0
+    }
+    return newest;
+}
+
+/*
+ * Write stats as the newest record, in the slot after newest.
+ */
+static void stats_store(stats_t *stats, uint8_t newest) {
+    uint8_t slot = newest + 1 == STATS_SLOTS ? 0 : newest + 1;
+
+    stats->seq++;
+    stats->crc = stats_crc(stats);
+    wdt_reset();
+    eeprom_update_block(stats, &stats_slots[slot], sizeof(*stats));
+    wdt_reset();
+}
+
+void stats_init(void) {
+    stats_session = STATS_NONE;
+}
+
+void stats_begin(uint8_t session) {
+    stats_session = session;
+    stats_outcome = STATS_ABORTED;
+    stats_naks = 0;
+    hal_clock_start();
+}
+
+void stats_result(uint8_t result) {
+    stats_outcome = result;
+}
+
+void stats_nak(void) {
+    stats_naks++;
+}
+
+void stats_end(void) {
+    stats_t stats;
+    uint8_t newest;
+
+    if (stats_session == STATS_NONE) {
+        return;
+    }
+    newest = stats_load(&stats);
+
+    if (stats_session == STATS_READBACK) {
+        stats.readbacks++;
+    }
+    else {
+        uint32_t ms = hal_clock_ms();
+
+        stats.updates++;
+        if (stats_outcome == STATS_OK) {
+            stats.updates_ok++;
+        }
+        else if (stats_outcome == STATS_AUTH_FAIL) {
+            stats.auth_fail++;
+        }
+        else if (stats_outcome == STATS_IMAGE_FAIL) {
+            stats.image_fail++;
+        }
+        else {
+            stats.aborted++;
+        }
+        stats.naks += stats_naks;
+        stats.session_ms += ms;
+        stats.last_ms = ms;
+    }
+    stats_session = STATS_NONE;
+    stats_store(&stats, newest);
+}
+
+/*
+ * The ring reads as lap + 1 up to position and lap from there on, where lap
+ * is the value of its last byte. An erased ring is all 0xFF, lap 0xFF at
+ * position 0, which counts as 0.
+ */
+static uint8_t stats_ring_position(uint8_t *lap) {
+    uint8_t position = 0;
+
+    *lap = eeprom_read_byte(&boot_ring[STATS_BOOT_RING - 1]);
+    while (eeprom_read_byte(&boot_ring[position]) != *lap) {
+        position++;  // Stops at the last byte at the latest
+    }
+    return position;
+}
+
+uint32_t stats_boots(void) {
+    stats_t stats;
+    uint8_t lap;
+    uint8_t position = stats_ring_position(&lap);
+
+    stats_load(&stats);
+    return ((uint32_t) stats.boot_laps << 8 | (uint8_t)(lap + 1)) * STATS_BOOT_RING
+        + position;
+}
+
+void stats_boot(void) {
+    uint8_t lap;
+    uint8_t position = stats_ring_position(&lap);
+
+    // Only this byte changes, the write finishes while the application starts
+    eeprom_write_byte(&boot_ring[position], lap + 1);
+
+    if (position == STATS_BOOT_RING - 1 && (uint8_t)(lap + 1) == 0xFF) {
+        stats_t stats;
+        uint8_t newest = stats_load(&stats);
+
+        // Back to the erased state, carry the lap into a record
+        stats.boot_laps++;
+        stats_store(&stats, newest);
+    }
+}
@@ -1,10 +1,41 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
 
-void __Init(void) __attribute__ ((naked)) __attribute__ ((section (".vectors")));
+void __vectors(void) __attribute__ ((naked)) __attribute__ ((section (".vectors")));
+void __bad_interrupt(void) __attribute__ ((naked));
+void __Init(void) __attribute__ ((naked)) __attribute__ ((section (".init0")));
 void __do_copy_data(void) __attribute__ ((naked)) __attribute__ ((section (".init4")));
 void __jumpMain(void) __attribute__ ((naked)) __attribute__ ((section (".init9")));
 
+/*
+ * Interrupt vector table at the start of the boot section. __Init moves the
+ * vectors here with IVSEL, so the bootloader can use interrupts without
+ * touching the application's table at address 0. Each vector is a weak alias
+ * of __bad_interrupt until an ISR() with the same name is linked in.
+ */
+void __vectors(void) {
+    __asm__ __volatile__
+    (
+        ".macro vector n                        \n\t"
+        ".weak __vector_\\n                     \n\t"
+        ".set __vector_\\n, __bad_interrupt     \n\t"
+        "jmp __vector_\\n                       \n\t"
+        ".endm                                  \n\t"
+        "jmp __Init                             \n\t"
+        ".irp n, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, "
+        "18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34 \n\t"
+        "vector \\n                              \n\t"
+        ".endr                                  \n\t"
+    );
+}
+
+/*
+ * An interrupt fired without a handler, start the bootloader over.
+ */
+void __bad_interrupt(void) {
+    __asm__ __volatile__ ("jmp __vectors");
+}
+
 void __Init(void) {
 #if 0
     // init stack here, bug in WinAVR 20071221 does not init stack based on __stack
@@ -34,10 +65,13 @@ void __Init(void) {
     //     Turn off Watchdog Timer
     //-------------------------------------------------------------------
 
-    // Clear wdt reset flag - needed for enhanced wdt devices
+    // Clear wdt reset flag - needed for enhanced wdt devices. The reset
+    // cause is kept in GPIOR0 for mailbox_take().
     #if defined(MCUCSR)
+        GPIOR0 = MCUCSR;
         MCUCSR = 0;
     #elif defined(MCUSR)
+        GPIOR0 = MCUSR;
         MCUSR = 0;
     #endif
 
@@ -46,9 +80,14 @@ void __Init(void) {
         "ldi r24, %0            \n\t"
         "sts %1, r24            \n\t"
         "sts %1, __zero_reg__    \n\t"
+        "ldi r24, %2            \n\t"  // Move the vectors to the boot section,
+        "out %3, r24            \n\t"  // IVSEL must follow IVCE within 4 cycles
+        "ldi r24, %4            \n\t"
+        "out %3, r24            \n\t"
         "rjmp __do_copy_data    \n\t"  // Jmp over the data section
         :
-        : "M" ((1<<_WD_CHANGE_BIT) | (1<<WDE)),    "M" (_SFR_MEM_ADDR(_WD_CONTROL_REG))
+        : "M" ((1<<_WD_CHANGE_BIT) | (1<<WDE)),    "M" (_SFR_MEM_ADDR(_WD_CONTROL_REG)),
+          "M" (1<<IVCE), "I" (_SFR_IO_ADDR(MCUCR)), "M" (1<<IVSEL)
     );
 }
 
@@ -0,0 +1,78 @@
+/* Debug trace channel on UART0 */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdint.h>
+#include "trace.h"
+#include "sched.h"
+
+// Byte ring drained by the UDRE0 interrupt, the 8 bit indices wrap at 256.
+// .bss is not cleared at startup (see sys_startup.c), trace_init() resets them.
+static volatile uint8_t trace_buffer[256];
+static volatile uint8_t trace_head;
+static volatile uint8_t trace_tail;
+static uint32_t trace_drops;
+
+static bool trace_empty(void);
+
+void trace_init(void) {
+    trace_head = 0;
+    trace_tail = 0;
+    trace_drops = 0;
+}
+
+/*
+ * Copy one record into the ring, the caller has made sure it fits.
+ */
+static void trace_put(uint8_t event, uint32_t arg) {
+    uint8_t head = trace_head;
+
+    trace_buffer[head++] = TRACE_SYNC;
+    trace_buffer[head++] = event;
+    trace_buffer[head++] = (uint8_t)(arg >> 24);
+    trace_buffer[head++] = (uint8_t)(arg >> 16);
+    trace_buffer[head++] = (uint8_t)(arg >> 8);
+    trace_buffer[head++] = (uint8_t) arg;
+    trace_head = head;
+}
+
+void trace_record(uint8_t event, uint32_t arg) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // One byte always stays empty so a full ring is not mistaken for empty
+        uint8_t space = trace_tail - trace_head - 1;
+
+        if (trace_drops != 0) {
+            if (space < 2 * TRACE_RECORD_SIZE) {
+                trace_drops++;
+                return;
+            }
+            trace_put(TRACE_DROPPED, trace_drops);
+            trace_drops = 0;
+        }
+        else if (space < TRACE_RECORD_SIZE) {
+            trace_drops++;
+            return;
+        }
+        trace_put(event, arg);
+        UCSR0B |= (1 << UDRIE0);
+    }
+}
+
+static bool trace_empty(void) {
+    return trace_head == trace_tail && !(UCSR0B & (1 << UDRIE0));
+}
+
+void trace_flush(void) {
+    while (!trace_empty()) {
+        sched_idle(trace_empty);  // The UDRE0 interrupt wakes us
+    }
+}
+
+ISR(USART0_UDRE_vect) {
+    if (trace_head == trace_tail) {
+        UCSR0B &= ~(1 << UDRIE0);  // Nothing left, stop the interrupt
+        return;
+    }
+    UDR0 = trace_buffer[trace_tail];
+    trace_tail++;
+}
@@ -1,6 +1,31 @@
 /* UART driver code */
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+#include <util/atomic.h>
 #include "uart.h"
+#include "sched.h"
+
+// Transmit ring for UART1, the 8 bit indices wrap at exactly 256 entries.
+// .bss is not cleared at startup (see sys_startup.c), UART1_init() resets them.
+static volatile unsigned char tx1_buffer[256];
+static volatile uint8_t tx1_head;
+static volatile uint8_t tx1_tail;
+
+// Receive ring for UART1, filled by the RXC interrupt so bytes keep arriving
+// while a background step runs.
+static volatile unsigned char rx1_buffer[256];
+static volatile uint8_t rx1_head;
+static volatile uint8_t rx1_tail;
+
+// Milliseconds left in UART1_getchar_timeout(), counted down by Timer0
+static volatile uint16_t rx1_timeout;
+#define TIMER0_PRESCALE 256
+#define TIMER0_MS_TOP ((F_CPU / TIMER0_PRESCALE / 1000) - 1)
+
+static bool tx1_has_room(void);
+static bool tx1_empty(void);
+static bool rx1_ready_or_timed_out(void);
 
 void UART1_init(void) {
     // Set the baud rate
@@ -14,10 +39,28 @@ void UART1_init(void) {
     UCSR1A &= ~(1 << U2X1);
     #endif
 
-    UCSR1B = (1 << RXEN1) | (1 << TXEN1);  // Enable receive and transmit
+    tx1_head = 0;
+    tx1_tail = 0;
+    rx1_head = 0;
+    rx1_tail = 0;
+
+    // Enable receive (with its interrupt) and transmit
+    UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
     UCSR1C = (1 << UCSZ11) | (1 << UCSZ10);  // Use 8-bit character sizes
 }
 
+void UART1_set_baud(uint16_t ubrr, bool u2x) {
+    UBRR1H = (uint8_t)(ubrr >> 8);
+    UBRR1L = (uint8_t) ubrr;
+
+    if (u2x) {
+        UCSR1A |= (1 << U2X1);
+    }
+    else {
+        UCSR1A &= ~(1 << U2X1);
+    }
+}
+
 void UART1_putchar(unsigned char data) {
     while (!(UCSR1A & (1 << UDRE1))) {
         // Wait for the last bit to send.
@@ -25,25 +68,122 @@ void UART1_putchar(unsigned char data) {
     UDR1 = data;
 }
 
+/*
+ * Queue a byte for the UDRE interrupt to send. Only blocks while the ring is
+ * full, so the caller can read flash while earlier bytes are still shifting.
+ * Interrupts must be enabled.
+ */
+void UART1_putchar_buffered(unsigned char data) {
+    uint8_t next = tx1_head + 1;
+    while (next == tx1_tail) {
+        sched_idle(tx1_has_room);  // The UDRE interrupt wakes us
+    }
+    tx1_buffer[tx1_head] = data;
+    tx1_head = next;
+    UCSR1B |= (1 << UDRIE1);
+}
+
+/*
+ * Wait until every queued byte has left the shift register. Call this before
+ * going back to UART1_putchar() or resetting.
+ */
+void UART1_drain(void) {
+    while (!tx1_empty()) {
+        sched_idle(tx1_empty);
+    }
+    while (!(UCSR1A & (1 << TXC1))) {
+        // Wait for the last bit to send
+    }
+}
+
+static bool tx1_has_room(void) {
+    return (uint8_t)(tx1_head + 1) != tx1_tail;
+}
+
+static bool tx1_empty(void) {
+    return tx1_head == tx1_tail && !(UCSR1B & (1 << UDRIE1));
+}
+
+ISR(USART1_UDRE_vect) {
+    if (tx1_head == tx1_tail) {
+        UCSR1B &= ~(1 << UDRIE1);  // Nothing left, stop the interrupt
+        return;
+    }
+    // Clear TXC (by writing a one) so UART1_drain() sees this byte finish
+    UCSR1A = (UCSR1A & ((1 << U2X1) | (1 << MPCM1))) | (1 << TXC1);
+    UDR1 = tx1_buffer[tx1_tail];
+    tx1_tail++;
+}
+
+ISR(USART1_RX_vect) {
+    unsigned char data = UDR1;
+    uint8_t next = rx1_head + 1;
+
+    // A full ring drops the byte, the frame CRC catches it
+    if (next != rx1_tail) {
+        rx1_buffer[rx1_head] = data;
+        rx1_head = next;
+    }
+}
+
 bool UART1_data_available(void) {
-    return (UCSR1A & (1 << RXC1)) != 0;
+    return rx1_head != rx1_tail;
 }
 
 unsigned char UART1_getchar(void) {
     while (!UART1_data_available()) {
-        // Wait for data to be received
+        sched_idle(UART1_data_available);  // Background work, else sleep
     }
-    return UDR1;  // Get and return received data from buffer
+    unsigned char data = rx1_buffer[rx1_tail];
+    rx1_tail++;
+    return data;
 }
 
-void UART1_flush(void) {
-    // Tell the compiler that this variable is not being used
-    unsigned char __attribute__ ((unused)) dummy;  // GCC attributes
-    while (UART1_data_available()) {
-        dummy = UDR1;
+ISR(TIMER0_COMPA_vect) {
+    if (rx1_timeout != 0) {
+        rx1_timeout--;
     }
 }
 
+static bool rx1_ready_or_timed_out(void) {
+    uint16_t left;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        left = rx1_timeout;
+    }
+    return UART1_data_available() || left == 0;
+}
+
+int UART1_getchar_timeout(uint16_t timeout_ms) {
+    if (UART1_data_available()) {
+        return UART1_getchar();
+    }
+
+    // Tick every millisecond until a byte arrives, the tick also wakes the
+    // CPU from idle sleep to check the deadline
+    rx1_timeout = timeout_ms;
+    TCNT0 = 0;
+    OCR0A = TIMER0_MS_TOP;
+    TCCR0A = (1 << WGM01);  // CTC
+    TIFR0 = (1 << OCF0A);
+    TIMSK0 = (1 << OCIE0A);
+    TCCR0B = (1 << CS02);  // F_CPU / 256
+
+    while (!rx1_ready_or_timed_out()) {
+        sched_idle(rx1_ready_or_timed_out);
+    }
+
+    TCCR0B = 0;
+    TIMSK0 = 0;
+    if (!UART1_data_available()) {
+        return -1;
+    }
+    return UART1_getchar();
+}
+
+void UART1_flush(void) {
+    rx1_tail = rx1_head;
+}
+
 void UART1_putstring(char* str) {
     int i = 0;
     while (str[i] != 0) {